@@ -8,7 +8,33 @@
 #else
 #include <windows.h>
 #endif
+#ifdef HAVE_SYSCONF
+#include <unistd.h>
+#endif
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#ifdef HAVE_PTHREADS
+#include <cctype>
+#include <set>
+#endif
+#ifdef HAVE_FORK
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "tables.h"
+#include "tables-inline.h"
 
 using namespace std;
 
@@ -18,34 +44,32 @@ using namespace std;
 // points. Then we'll plot them, and we'll be able to see noise, nonlinearity,
 // and any other nonobvious weirdness.
 
-// Run a Test of size n once. Return the elapsed time in seconds.
-template <class Test>
-double measure_single_run(size_t n)
+// Return the current time in seconds, measured from some arbitrary point.
+double now_seconds()
 {
-    Test test;
-    test.setup(n);
-
 #ifdef HAVE_GETTIMEOFDAY
-    struct timeval t0, t1;
-    gettimeofday(&t0, NULL);
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + 1e-6 * t.tv_usec;
 #else
-    LARGE_INTEGER f, t0, t1;
+    LARGE_INTEGER f, t;
     if (!QueryPerformanceFrequency(&f))
         abort();
-    if (!QueryPerformanceCounter(&t0))
+    if (!QueryPerformanceCounter(&t))
         abort();
+    return double(t.QuadPart) / double(f.QuadPart);
 #endif
+}
 
+// Run a Test of size n once. Return the elapsed time in seconds.
+template <class Test>
+double measure_single_run(size_t n)
+{
+    Test test;
+    test.setup(n);
+    double t0 = now_seconds();
     test.run(n);
-
-#ifdef HAVE_GETTIMEOFDAY
-    gettimeofday(&t1, NULL);
-    return t1.tv_sec - t0.tv_sec + 1e-6 * (t1.tv_usec - t0.tv_usec);
-#else
-    if (!QueryPerformanceCounter(&t1))
-        abort();
-    return double(t1.QuadPart - t0.QuadPart) / double(f.QuadPart);
-#endif
+    return now_seconds() - t0;
 }
 
 const double min_run_seconds = 0.1;
@@ -58,27 +82,36 @@ const double max_run_seconds = 1.0;
 // resizes) that occur at exponentially spaced intervals. We want to make sure
 // we don't miss those.
 //
+// Estimate how many iterations per second we can do.
 template <class Test>
-void run_time_trials()
+double estimate_speed()
 {
-    cout << "[\n";
-
-    // Estimate how many iterations per second we can do.
-    double estimated_speed;
     for (size_t n = 1; ; n *= 2) {
         double dt = measure_single_run<Test>(n);
-        if (dt >= min_run_seconds) {
-            estimated_speed = n / dt;
-            break;
-        }
+        if (dt >= min_run_seconds)
+            return n / dt;
     }
+}
+
+// Return the size of trial i of the given number of trials. The trials are
+// sized to take between min_run_seconds and max_run_seconds, evenly spaced.
+size_t trial_size(double estimated_speed, int i, int trials)
+{
+    double target_dt = min_run_seconds + double(i) / (trials - 1) * (max_run_seconds - min_run_seconds);
+    return size_t(ceil(estimated_speed * target_dt));
+}
+
+template <class Test>
+void run_time_trials()
+{
+    cout << "[\n";
+
+    double estimated_speed = estimate_speed<Test>();
 
     // Now run trials of increasing size and print the results.
-    double total = 0;
     const int trials = Test::trials();
     for (int i = 0; i < trials; i++) {
-        double target_dt = min_run_seconds + double(i) / (trials - 1) * (max_run_seconds - min_run_seconds);
-        size_t n = size_t(ceil(estimated_speed * target_dt));
+        size_t n = trial_size(estimated_speed, i, trials);
         double dt = measure_single_run<Test>(n);
         cout << "\t\t[" << n << ", " << dt << (i < trials - 1 ? "]," : "]") << endl;
     }
@@ -87,8 +120,32 @@ void run_time_trials()
 }
 
 
+// A small, fast pseudorandom number generator (Marsaglia's xorshift64).
+// state must not be zero.
+uint64_t xorshift(uint64_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+
 // === Tests
 
+// Return k, hiding from the optimizer that the result equals k. When a
+// table's get() is inlined (see tables-inline.h), the compiler can see that
+// k == table.get(k) after a successful check, and may compute the next key
+// from the value it just loaded instead of from k, which makes every lookup
+// wait for the one before. That would measure the compiler, not the table.
+inline Key opaque(Key k)
+{
+#ifdef __GNUC__
+    __asm__("" : "+r"(k));
+#endif
+    return k;
+}
+
 struct GoodTest {
     static int trials() { return 10; }
 };
@@ -158,7 +215,8 @@ struct LookupHitTest : GoodTest {
     void run(size_t n) {
         Key k = 1;
         for (size_t i = 0; i < n; i++) {
-            if (table.get(k) != k)
+            Key probe = opaque(k);
+            if (table.get(probe) != probe)
                 abort();
             k = k * 31 % M;
         }
@@ -264,7 +322,7 @@ struct LookupAfterDeleteTest : GoodTest {
 
     void run(size_t n) {
         for (size_t i = 1; i <= n; i++) {
-            Key k = i % Size;
+            Key k = (i - 1) % Size + 1;   // never Key(0), which is reserved
             if (table.get(k) != ((k & 0xff) == 0 ? k : Value()))
                 abort();
         }
@@ -293,6 +351,93 @@ struct InsertAfterDeleteTest : GoodTest {
     }
 };
 
+// The next three tests iterate over a table while modifying it, the way a
+// Map.prototype.forEach callback might. Like forEach, they take the front
+// entry and pop it before doing anything to the table. Only tables with a
+// Range that tolerates modification can run them.
+
+// Iterate over the table, removing each entry as it is visited. The table
+// shrinks (and so compacts) several times along the way.
+template <class Table>
+struct IterateRemoveTest : GoodTest {
+    Table table;
+
+    void setup(size_t n) {
+        for (size_t i = 1; i <= n; i++)
+            table.set(i, i);
+    }
+
+    void run(size_t n) {
+        size_t visited = 0;
+        for (typename Table::Range r(table); !r.empty(); ) {
+            Key k = r.front_key();
+            r.popFront();
+            if (k != ++visited || !table.remove(k))
+                abort();
+        }
+        if (visited != n || table.size() != 0)
+            abort();
+    }
+};
+
+// Start with one entry and iterate, adding a new entry for each entry
+// visited, until n entries have been added. The new entries are visited
+// too. The table grows (and so compacts) several times along the way.
+template <class Table>
+struct IterateInsertTest : GoodTest {
+    Table table;
+
+    void setup(size_t) {
+        table.set(1, 1);
+    }
+
+    void run(size_t n) {
+        Key next = 2;
+        size_t visited = 0;
+        for (typename Table::Range r(table); !r.empty(); ) {
+            Key k = r.front_key();
+            r.popFront();
+            if (k != ++visited)
+                abort();
+            if (next <= n + 1) {
+                table.set(next, next);
+                next++;
+            }
+        }
+        if (visited != n + 1)
+            abort();
+    }
+};
+
+// Like WorklistTest, but driven by iteration: each entry visited is removed
+// and replaced by a new one at the end, so the iteration would go on forever;
+// stop after n entries. The table stays the same size, so set() compacts it
+// in place every time the entries vector fills up with removed entries.
+template <class Table>
+struct IterateMutateTest : GoodTest {
+    Table table;
+
+    enum { Size = 700 };
+
+    void setup(size_t) {
+        for (size_t i = 1; i <= Size; i++)
+            table.set(i, i);
+    }
+
+    void run(size_t n) {
+        Key next = Size + 1;
+        size_t visited = 0;
+        for (typename Table::Range r(table); visited < n; ) {
+            Key k = r.front_key();
+            r.popFront();
+            if (k != ++visited || !table.remove(k))
+                abort();
+            table.set(next, next);
+            next++;
+        }
+    }
+};
+
 template <template <class> class Test>
 void run_speed_test()
 {
@@ -315,103 +460,2694 @@ void run_speed_test()
     cout << "}";
 }
 
+// Run a speed test on the tables that keep entries in insertion order and
+// allow modification while iterating.
+template <template <class> class Test>
+void run_ordered_speed_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<Test<CloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// Every speed test, in the order run_all_speed_tests runs them.
+#define FOR_EACH_SPEED_TEST(macro) \
+    macro(InsertLargeTest) \
+    macro(InsertSmallTest) \
+    macro(LookupHitTest) \
+    macro(LookupMissTest) \
+    macro(WorklistTest) \
+    macro(DeleteTest) \
+    macro(LookupAfterDeleteTest) \
+    macro(InsertAfterDeleteTest)
+
+// Tests that only run_ordered_speed_test can run.
+#define FOR_EACH_ORDERED_SPEED_TEST(macro) \
+    macro(IterateRemoveTest) \
+    macro(IterateInsertTest) \
+    macro(IterateMutateTest)
+
 void run_one_speed_test(const char *name)
 {
-    if (strcmp(name, "InsertLargeTest") == 0)
-        run_speed_test<InsertLargeTest>();
-    else if (strcmp(name, "InsertSmallTest") == 0)
-        run_speed_test<InsertSmallTest>();
-    else if (strcmp(name, "LookupHitTest") == 0)
-        run_speed_test<LookupHitTest>();
-    else if (strcmp(name, "LookupMissTest") == 0)
-        run_speed_test<LookupMissTest>();
-    else if (strcmp(name, "WorklistTest") == 0)
-        run_speed_test<WorklistTest>();
-    else if (strcmp(name, "DeleteTest") == 0)
-        run_speed_test<DeleteTest>();
-    else if (strcmp(name, "LookupAfterDeleteTest") == 0)
-        run_speed_test<LookupAfterDeleteTest>();
-    else if (strcmp(name, "InsertAfterDeleteTest") == 0)
-        run_speed_test<InsertAfterDeleteTest>();
-    else {
-        cerr << "No such test: " << name << endl;
-        return;
+#define RUN_IF_NAMED(Test) \
+    if (strcmp(name, #Test) == 0) { \
+        run_speed_test<Test>(); \
+        cout << endl; \
+        return; \
     }
-    cout << endl;
+    FOR_EACH_SPEED_TEST(RUN_IF_NAMED)
+#undef RUN_IF_NAMED
+
+#define RUN_ORDERED_IF_NAMED(Test) \
+    if (strcmp(name, #Test) == 0) { \
+        run_ordered_speed_test<Test>(); \
+        cout << endl; \
+        return; \
+    }
+    FOR_EACH_ORDERED_SPEED_TEST(RUN_ORDERED_IF_NAMED)
+#undef RUN_ORDERED_IF_NAMED
+
+    cerr << "No such test: " << name << endl;
 }
 
 void run_all_speed_tests()
 {
     cout << "{" << endl;
 
-    cout << "\"InsertLargeTest\": ";
-    run_speed_test<InsertLargeTest>();
-    cout << "," << endl;
+    const char *separator = "";
+#define RUN_AND_PRINT(Test) \
+    cout << separator << "\"" #Test "\": "; \
+    run_speed_test<Test>(); \
+    separator = ",\n";
+    FOR_EACH_SPEED_TEST(RUN_AND_PRINT)
+#undef RUN_AND_PRINT
+
+#define RUN_ORDERED_AND_PRINT(Test) \
+    cout << separator << "\"" #Test "\": "; \
+    run_ordered_speed_test<Test>(); \
+    separator = ",\n";
+    FOR_EACH_ORDERED_SPEED_TEST(RUN_ORDERED_AND_PRINT)
+#undef RUN_ORDERED_AND_PRINT
+
+    cout << "\n}" << endl;
+}
 
-    cout << "\"InsertSmallTest\": ";
-    run_speed_test<InsertSmallTest>();
-    cout << "," << endl;
 
-    cout << "\"LookupHitTest\": ";
-    run_speed_test<LookupHitTest>();
-    cout << "," << endl;
+// === Inlined side by side
+//
+// Run each speed test on the out-of-line tables from tables.cpp and on the
+// header-only copies from tables-inline.h, alternating between the two, so
+// that the difference is the cost of the calls and nothing else. The output
+// has the same form as run_all_speed_tests.
 
-    cout << "\"LookupMissTest\": ";
-    run_speed_test<LookupMissTest>();
-    cout << "," << endl;
+template <template <class> class Test>
+void run_inlined_speed_test()
+{
+    cout << '{' << endl;
 
-    cout << "\"WorklistTest\": ";
-    run_speed_test<WorklistTest>();
-    cout << "," << endl;
+#ifdef HAVE_SPARSEHASH
+    cout << "\t\"DenseTable\": ";
+    run_time_trials<Test<DenseTable> >();
+    cout << ',' << endl;
 
-    cout << "\"DeleteTest\": ";
-    run_speed_test<DeleteTest>();
-    cout << "," << endl;
+    cout << "\t\"DenseTable (inlined)\": ";
+    run_time_trials<Test<inlined::DenseTable> >();
+    cout << ',' << endl;
+#endif
 
-    cout << "\"LookupAfterDeleteTest\": ";
-    run_speed_test<LookupAfterDeleteTest>();
+    cout << "\t\"OpenTable\": ";
+    run_time_trials<Test<OpenTable> >();
+    cout << ',' << endl;
 
-    cout << "\"InsertAfterDeleteTest\": ";
-    run_speed_test<InsertAfterDeleteTest>();
+    cout << "\t\"OpenTable (inlined)\": ";
+    run_time_trials<Test<inlined::OpenTable> >();
+    cout << ',' << endl;
 
-    cout << "}" << endl;
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<Test<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable (inlined)\": ";
+    run_time_trials<Test<inlined::CloseTable> >();
+    cout << endl;
+
+    cout << "}";
 }
 
-void measure_space(ByteSizeOption opt)
+template <template <class> class Test>
+void run_inlined_ordered_speed_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<Test<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable (inlined)\": ";
+    run_time_trials<Test<inlined::CloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// Run the named test side by side, or all of them if name is null.
+void run_inlined_speed_tests(const char *name)
+{
+    cout << "{" << endl;
+
+    bool found = false;
+    const char *separator = "";
+#define RUN_INLINED_AND_PRINT(Test) \
+    if (!name || strcmp(name, #Test) == 0) { \
+        cout << separator << "\"" #Test "\": "; \
+        run_inlined_speed_test<Test>(); \
+        separator = ",\n"; \
+        found = true; \
+    }
+    FOR_EACH_SPEED_TEST(RUN_INLINED_AND_PRINT)
+#undef RUN_INLINED_AND_PRINT
+
+#define RUN_INLINED_ORDERED_AND_PRINT(Test) \
+    if (!name || strcmp(name, #Test) == 0) { \
+        cout << separator << "\"" #Test "\": "; \
+        run_inlined_ordered_speed_test<Test>(); \
+        separator = ",\n"; \
+        found = true; \
+    }
+    FOR_EACH_ORDERED_SPEED_TEST(RUN_INLINED_ORDERED_AND_PRINT)
+#undef RUN_INLINED_ORDERED_AND_PRINT
+
+    cout << "\n}" << endl;
+    if (!found)
+        cerr << "No such test: " << name << endl;
+}
+
+
+// === Packed side by side
+//
+// Run each speed test that doesn't iterate on CloseTable and on
+// PackedCloseTable, which keeps its buckets and entries in one allocation.
+// The output has the same form as run_all_speed_tests.
+
+template <template <class> class Test>
+void run_packed_speed_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<Test<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"PackedCloseTable\": ";
+    run_time_trials<Test<PackedCloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// Run the named test side by side, or all of them if name is null.
+void run_packed_speed_tests(const char *name)
+{
+    cout << "{" << endl;
+
+    bool found = false;
+    const char *separator = "";
+#define RUN_PACKED_AND_PRINT(Test) \
+    if (!name || strcmp(name, #Test) == 0) { \
+        cout << separator << "\"" #Test "\": "; \
+        run_packed_speed_test<Test>(); \
+        separator = ",\n"; \
+        found = true; \
+    }
+    FOR_EACH_SPEED_TEST(RUN_PACKED_AND_PRINT)
+#undef RUN_PACKED_AND_PRINT
+
+    cout << "\n}" << endl;
+    if (!found)
+        cerr << "No such test: " << name << endl;
+}
+
+
+#ifdef HAVE_FORK
+// === Farm mode
+//
+// Run the whole speed test matrix on several cores at once. We fork one
+// worker per core, pin it there, and hand out jobs one at a time: first an
+// estimate_speed job for each test and table, then one job per trial. The
+// parent collects the results and prints them as a single JSON document of
+// the same form run_all_speed_tests prints, plus an "Interference" entry.
+//
+// We use the cores listed in /sys/devices/system/cpu/isolated if there are
+// any, otherwise every core this process may run on.
+//
+// Cores running side by side can slow each other down (shared caches and
+// memory bandwidth, SMT siblings, power limits), which would make the farm's
+// numbers worse than a serial run's. To detect that, each worker runs a
+// calibration job once with the others idle, and again at the end with every
+// worker running it at the same time. "Interference" lists
+// [core, seconds alone, seconds together] for each worker.
+
+struct FarmTest {
+    const char *test;
+    const char *table;
+    int trials;
+    double (*estimate)();
+    double (*measure)(size_t n);
+
+    std::vector<size_t> sizes;      // size of each trial
+    std::vector<double> times;      // result of each trial job
+    std::vector<size_t> peak_rss;   // peak RSS of each trial (isolated mode)
+};
+
+enum FarmJobKind { EstimateJob, TrialJob, CalibrationJob, QuitJob };
+
+struct FarmJob {
+    FarmJobKind kind;
+    size_t test;    // index into the FarmTest vector
+    size_t n;       // size of the trial
+};
+
+struct FarmWorker {
+    int cpu;
+    pid_t pid;
+    int jobs_fd;        // parent writes FarmJobs here
+    int results_fd;     // and reads back one double per job
+    size_t job;         // index of the job the worker is running
+};
+
+template <class Test>
+void add_farm_test(std::vector<FarmTest> &tests, const char *test, const char *table)
+{
+    FarmTest t;
+    t.test = test;
+    t.table = table;
+    t.trials = Test::trials();
+    t.estimate = estimate_speed<Test>;
+    t.measure = measure_single_run<Test>;
+    tests.push_back(t);
+}
+
+template <template <class> class Test>
+void add_farm_tests(std::vector<FarmTest> &tests, const char *test)
 {
 #ifdef HAVE_SPARSEHASH
-    DenseTable ht0;
+    add_farm_test<Test<DenseTable> >(tests, test, "DenseTable");
 #endif
-    OpenTable ht1;
-    CloseTable ht2;
+    add_farm_test<Test<OpenTable> >(tests, test, "OpenTable");
+    add_farm_test<Test<CloseTable> >(tests, test, "CloseTable");
+}
 
-    for (int i = 0; i < 100000; i++) {
-        cout << i << '\t'
-#ifdef HAVE_SPARSEHASH
-             << ht0.byte_size(opt) << '\t'
-#else
-             << 1 << '\t'
+template <template <class> class Test>
+void add_ordered_farm_tests(std::vector<FarmTest> &tests, const char *test)
+{
+    add_farm_test<Test<CloseTable> >(tests, test, "CloseTable");
+}
+
+// The calibration job. It is a lookup test because those are the most
+// sensitive to sharing caches and memory bandwidth.
+double run_calibration_job()
+{
+    return measure_single_run<LookupHitTest<OpenTable> >(20000000);
+}
+
+// Parse a list of CPUs like "0-3,8,10-11".
+std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    const char *p = list.c_str();
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        int first = int(strtol(p, &end, 10));
+        int last = first;
+        if (*end == '-')
+            last = int(strtol(end + 1, &end, 10));
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+std::vector<int> farm_cpus()
+{
+    std::string isolated;
+    std::ifstream f("/sys/devices/system/cpu/isolated");
+    getline(f, isolated);
+    std::vector<int> cpus = parse_cpu_list(isolated);
+    if (!cpus.empty())
+        return cpus;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
 #endif
-             << ht1.byte_size(opt) << '\t' << ht2.byte_size(opt) << endl;
 
-#ifdef HAVE_SPARSEHASH
-        ht0.set(i + 1, i);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int cpu = 0; cpu < n; cpu++)
+        cpus.push_back(cpu);
+    return cpus;
+}
+
+void farm_worker_main(int cpu, int jobs_fd, int results_fd, std::vector<FarmTest> &tests)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) != 0) {
+        cerr << "can't pin worker to cpu " << cpu << endl;
+        _exit(1);
+    }
+#else
+    (void) cpu;
 #endif
-        ht1.set(i + 1, i);
-        ht2.set(i + 1, i);
+
+    FarmJob job;
+    while (read(jobs_fd, &job, sizeof job) == ssize_t(sizeof job)) {
+        double result;
+        switch (job.kind) {
+          case EstimateJob:
+            result = tests[job.test].estimate();
+            break;
+          case TrialJob:
+            result = tests[job.test].measure(job.n);
+            break;
+          case CalibrationJob:
+            result = run_calibration_job();
+            break;
+          default:
+            _exit(0);
+        }
+        if (write(results_fd, &result, sizeof result) != ssize_t(sizeof result))
+            _exit(1);
     }
+    _exit(0);
 }
 
-int main(int argc, const char **argv) {
-    if (argc == 2 && (strcmp(argv[1], "-m") == 0 || strcmp(argv[1], "-w") == 0)) {
-        measure_space(argv[1][1] == 'm' ? BytesAllocated : BytesWritten);
-    } else if (argc == 1) {
-        //cout << measure_single_run<LookupHitTest<OpenTable> >(1000000) << endl;
-        run_all_speed_tests();
-    } else if (argc == 2) {
-        run_one_speed_test(argv[1]);
-    } else {
-        cerr << "usage:\n  " << argv[0] << "\n  " << argv[0] << " -m\n  " << argv[0] << " -w\n";
+// Fork worker i. The child closes its copies of the other workers' pipes,
+// so that each worker sees end-of-file when the parent closes its jobs pipe.
+void farm_start(std::vector<FarmWorker> &workers, size_t i, std::vector<FarmTest> &tests)
+{
+    int jobs_pipe[2], results_pipe[2];
+    if (pipe(jobs_pipe) != 0 || pipe(results_pipe) != 0)
+        abort();
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+        abort();
+    if (pid == 0) {
+        for (size_t j = 0; j < workers.size(); j++) {
+            if (j != i && workers[j].pid > 0) {
+                close(workers[j].jobs_fd);
+                close(workers[j].results_fd);
+            }
+        }
+        close(jobs_pipe[1]);
+        close(results_pipe[0]);
+        farm_worker_main(workers[i].cpu, jobs_pipe[0], results_pipe[1], tests);
+    }
+    close(jobs_pipe[0]);
+    close(results_pipe[1]);
+    workers[i].pid = pid;
+    workers[i].jobs_fd = jobs_pipe[1];
+    workers[i].results_fd = results_pipe[0];
+}
+
+void farm_send(FarmWorker &w, const FarmJob &job)
+{
+    // If the worker has died, this fails, and farm_receive reports it.
+    if (write(w.jobs_fd, &job, sizeof job) != ssize_t(sizeof job))
+        return;
+}
+
+// Return the result of the job worker i is running, or -1 if it died (a test
+// can abort, or run out of memory). A dead worker is replaced.
+double farm_receive(std::vector<FarmWorker> &workers, size_t i, std::vector<FarmTest> &tests,
+                    const FarmJob &job)
+{
+    FarmWorker &w = workers[i];
+    double result;
+    if (read(w.results_fd, &result, sizeof result) == ssize_t(sizeof result))
+        return result;
+
+    cerr << "farm worker on cpu " << w.cpu << " died running ";
+    if (job.kind == CalibrationJob)
+        cerr << "the calibration job";
+    else
+        cerr << tests[job.test].test << "<" << tests[job.test].table << ">";
+    if (job.kind == TrialJob)
+        cerr << " with n=" << job.n;
+    cerr << endl;
+
+    close(w.jobs_fd);
+    close(w.results_fd);
+    waitpid(w.pid, NULL, 0);
+    w.pid = 0;
+    farm_start(workers, i, tests);
+    return -1;
+}
+
+// Run all the jobs, as many at a time as there are workers.
+std::vector<double> farm_run(std::vector<FarmWorker> &workers, std::vector<FarmTest> &tests,
+                             const std::vector<FarmJob> &jobs)
+{
+    std::vector<double> results(jobs.size());
+    std::vector<pollfd> fds(workers.size());
+    size_t next = 0, done = 0;
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        fds[i].fd = -1;
+        fds[i].events = POLLIN;
+        if (next < jobs.size()) {
+            workers[i].job = next;
+            farm_send(workers[i], jobs[next++]);
+            fds[i].fd = workers[i].results_fd;
+        }
+    }
+
+    while (done < jobs.size()) {
+        if (poll(&fds[0], fds.size(), -1) < 0)
+            abort();
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (fds[i].fd < 0 || !fds[i].revents)
+                continue;
+            size_t job = workers[i].job;
+            results[job] = farm_receive(workers, i, tests, jobs[job]);
+            done++;
+            fds[i].fd = -1;
+            if (next < jobs.size()) {
+                workers[i].job = next;
+                farm_send(workers[i], jobs[next++]);
+                fds[i].fd = workers[i].results_fd;
+            }
+        }
+    }
+    return results;
+}
+
+void run_farm(size_t max_workers)
+{
+    std::vector<FarmTest> tests;
+#define ADD_FARM_TESTS(Test) add_farm_tests<Test>(tests, #Test);
+    FOR_EACH_SPEED_TEST(ADD_FARM_TESTS)
+#undef ADD_FARM_TESTS
+#define ADD_ORDERED_FARM_TESTS(Test) add_ordered_farm_tests<Test>(tests, #Test);
+    FOR_EACH_ORDERED_SPEED_TEST(ADD_ORDERED_FARM_TESTS)
+#undef ADD_ORDERED_FARM_TESTS
+
+    std::vector<int> cpus = farm_cpus();
+    if (max_workers && cpus.size() > max_workers)
+        cpus.resize(max_workers);
+
+    // Start the workers. We find out that one died when reading from it,
+    // not from SIGPIPE.
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<FarmWorker> workers(cpus.size());
+    for (size_t i = 0; i < cpus.size(); i++) {
+        workers[i].cpu = cpus[i];
+        workers[i].pid = 0;
+    }
+    for (size_t i = 0; i < cpus.size(); i++)
+        farm_start(workers, i, tests);
+
+    // Calibrate each core alone.
+    FarmJob calibrate = { CalibrationJob, 0, 0 };
+    std::vector<double> alone(workers.size());
+    for (size_t i = 0; i < workers.size(); i++) {
+        farm_send(workers[i], calibrate);
+        alone[i] = farm_receive(workers, i, tests, calibrate);
+    }
+
+    // Estimate the speed of each test, then size and run the trials.
+    std::vector<FarmJob> jobs;
+    for (size_t i = 0; i < tests.size(); i++) {
+        FarmJob job = { EstimateJob, i, 0 };
+        jobs.push_back(job);
+    }
+    std::vector<double> speeds = farm_run(workers, tests, jobs);
+
+    jobs.clear();
+    for (size_t i = 0; i < tests.size(); i++) {
+        if (speeds[i] < 0)
+            continue;
+        for (int t = 0; t < tests[i].trials; t++) {
+            FarmJob job = { TrialJob, i, trial_size(speeds[i], t, tests[i].trials) };
+            tests[i].sizes.push_back(job.n);
+            jobs.push_back(job);
+        }
+    }
+    std::vector<double> times = farm_run(workers, tests, jobs);
+    for (size_t j = 0; j < jobs.size(); j++)
+        tests[jobs[j].test].times.push_back(times[j]);
+
+    // Calibrate all the cores at once, then shut the workers down.
+    for (size_t i = 0; i < workers.size(); i++)
+        farm_send(workers[i], calibrate);
+    std::vector<double> together(workers.size());
+    for (size_t i = 0; i < workers.size(); i++)
+        together[i] = farm_receive(workers, i, tests, calibrate);
+
+    FarmJob quit = { QuitJob, 0, 0 };
+    for (size_t i = 0; i < workers.size(); i++) {
+        farm_send(workers[i], quit);
+        close(workers[i].jobs_fd);
+        close(workers[i].results_fd);
+        waitpid(workers[i].pid, NULL, 0);
+    }
+
+    // Print the results, leaving out failed trials, and tests with no
+    // results at all.
+    cout << "{" << endl;
+    const char *test = NULL;
+    for (size_t i = 0; i < tests.size(); i++) {
+        const FarmTest &t = tests[i];
+        std::vector<size_t> ok;
+        for (size_t j = 0; j < t.times.size(); j++) {
+            if (t.times[j] >= 0)
+                ok.push_back(j);
+        }
+        if (ok.empty())
+            continue;
+
+        if (!test || strcmp(test, t.test) != 0) {
+            if (test)
+                cout << "\n}," << endl;
+            cout << "\"" << t.test << "\": {" << endl;
+        } else {
+            cout << "," << endl;
+        }
+        test = t.test;
+
+        cout << "\t\"" << t.table << "\": [\n";
+        for (size_t j = 0; j < ok.size(); j++) {
+            cout << "\t\t[" << t.sizes[ok[j]] << ", " << t.times[ok[j]]
+                 << (j < ok.size() - 1 ? "]," : "]") << endl;
+        }
+        cout << "\t]";
+    }
+    if (test)
+        cout << "\n}," << endl;
+
+    cout << "\"Interference\": [\n";
+    for (size_t i = 0; i < workers.size(); i++) {
+        cout << "\t[" << workers[i].cpu << ", " << alone[i] << ", " << together[i]
+             << (i < workers.size() - 1 ? "]," : "]") << endl;
+        if (alone[i] > 0 && together[i] > alone[i] * 1.1) {
+            cerr << "warning: cpu " << workers[i].cpu << " ran the calibration job "
+                 << int((together[i] / alone[i] - 1) * 100)
+                 << "% slower with the other workers busy" << endl;
+        }
+    }
+    cout << "]\n}" << endl;
+}
+
+
+// === Isolated trials
+//
+// Run every estimate and every trial in a freshly forked child, so that no
+// trial inherits the heap that earlier ones left behind, and get each child's
+// peak RSS from wait4(). Within each test the tables run in a random order,
+// shuffled again for every trial, so that no table always runs right after
+// another one.
+//
+// The output has the form run_all_speed_tests prints, except that each point
+// is [n, seconds, peak RSS in bytes]. "IsolationBaseline" is the peak RSS of
+// a child that does nothing; every trial's peak includes it. A trial whose
+// child dies is left out.
+
+// Fork a child that runs a job of the given kind for test t (or nothing, if
+// t is NULL). Return false if the child failed.
+bool run_isolated(const FarmTest *t, FarmJobKind kind, size_t n,
+                  double &result, size_t &peak_rss)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        abort();
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+        abort();
+    if (pid == 0) {
+        close(fds[0]);
+        double r = 0;
+        if (t && kind == EstimateJob)
+            r = t->estimate();
+        else if (t && kind == TrialJob)
+            r = t->measure(n);
+        _exit(write(fds[1], &r, sizeof r) == sizeof r ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], &result, sizeof result);
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid)
+        abort();
+    if (got != sizeof result || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+#ifdef __APPLE__
+    peak_rss = size_t(usage.ru_maxrss);         // bytes on Mac
+#else
+    peak_rss = size_t(usage.ru_maxrss) * 1024;  // kilobytes elsewhere
+#endif
+    return true;
+}
+
+void shuffle_indexes(std::vector<size_t> &v, uint64_t &rng)
+{
+    for (size_t i = v.size(); i > 1; i--)
+        swap(v[i - 1], v[xorshift(rng) % i]);
+}
+
+// Run the named test, or all of them if name is null.
+void run_isolated_trials(const char *name)
+{
+    std::vector<FarmTest> tests;
+#define ADD_FARM_TESTS(Test) add_farm_tests<Test>(tests, #Test);
+    FOR_EACH_SPEED_TEST(ADD_FARM_TESTS)
+#undef ADD_FARM_TESTS
+#define ADD_ORDERED_FARM_TESTS(Test) add_ordered_farm_tests<Test>(tests, #Test);
+    FOR_EACH_ORDERED_SPEED_TEST(ADD_ORDERED_FARM_TESTS)
+#undef ADD_ORDERED_FARM_TESTS
+
+    uint64_t rng = uint64_t(now_seconds() * 1e6) | 1;
+    cerr << "random seed: " << rng << endl;
+
+    double ignored;
+    size_t baseline = 0;
+    run_isolated(NULL, TrialJob, 0, ignored, baseline);
+
+    cout << "{" << endl;
+    bool found = false;
+    for (size_t begin = 0, end; begin < tests.size(); begin = end) {
+        // The tables of one test are next to each other in tests.
+        for (end = begin + 1; end < tests.size() && strcmp(tests[end].test, tests[begin].test) == 0; end++)
+            ;
+        if (name && strcmp(name, tests[begin].test) != 0)
+            continue;
+        found = true;
+
+        std::vector<size_t> order;
+        for (size_t i = begin; i < end; i++)
+            order.push_back(i);
+
+        std::vector<double> speeds(tests.size(), -1);
+        shuffle_indexes(order, rng);
+        for (size_t j = 0; j < order.size(); j++) {
+            size_t rss;
+            if (!run_isolated(&tests[order[j]], EstimateJob, 0, speeds[order[j]], rss))
+                speeds[order[j]] = -1;
+        }
+
+        for (int trial = 0; trial < tests[begin].trials; trial++) {
+            shuffle_indexes(order, rng);
+            for (size_t j = 0; j < order.size(); j++) {
+                FarmTest &t = tests[order[j]];
+                if (speeds[order[j]] < 0)
+                    continue;
+                size_t n = trial_size(speeds[order[j]], trial, t.trials);
+                double dt;
+                size_t rss;
+                if (run_isolated(&t, TrialJob, n, dt, rss)) {
+                    t.sizes.push_back(n);
+                    t.times.push_back(dt);
+                    t.peak_rss.push_back(rss);
+                }
+            }
+        }
+
+        cout << "\"" << tests[begin].test << "\": {" << endl;
+        for (size_t i = begin; i < end; i++) {
+            const FarmTest &t = tests[i];
+            cout << "\t\"" << t.table << "\": [\n";
+            for (size_t j = 0; j < t.times.size(); j++) {
+                cout << "\t\t[" << t.sizes[j] << ", " << t.times[j] << ", " << t.peak_rss[j]
+                     << (j < t.times.size() - 1 ? "]," : "]") << endl;
+            }
+            cout << (i < end - 1 ? "\t],\n" : "\t]\n");
+        }
+        cout << "}," << endl;
+    }
+    cout << "\"IsolationBaseline\": " << baseline << "\n}" << endl;
+    if (name && !found)
+        cerr << "No such test: " << name << endl;
+}
+#endif  // HAVE_FORK
+
+void measure_space(ByteSizeOption opt)
+{
+#ifdef HAVE_SPARSEHASH
+    DenseTable ht0;
+#endif
+    OpenTable ht1;
+    CloseTable ht2;
+    QuotientTable ht3;
+    DirectTable ht4;
+
+    for (int i = 0; i < 100000; i++) {
+        cout << i << '\t'
+#ifdef HAVE_SPARSEHASH
+             << ht0.byte_size(opt) << '\t'
+#else
+             << 1 << '\t'
+#endif
+             << ht1.byte_size(opt) << '\t' << ht2.byte_size(opt) << '\t'
+             << FrozenTable::byte_size_for(i, i) << '\t' << ht3.byte_size(opt) << '\t'
+             << ht4.byte_size(opt) << endl;
+
+#ifdef HAVE_SPARSEHASH
+        ht0.set(i + 1, i);
+#endif
+        ht1.set(i + 1, i);
+        ht2.set(i + 1, i);
+        ht3.set(i + 1, i);
+        ht4.set(i + 1, i);
+    }
+}
+
+
+// === Tests over a list of sizes
+//
+// Several tests below measure a few series (tables, or ways of using one) at
+// each of a list of sizes, skipping sizes bigger than max_entries, and print
+// an object with one list of points per series:
+//     {"series name": [point, ...], ...}
+// run_sized_tests does the looping and printing; measure(n, points) does the
+// work for one size, appending one point to points[i] for each series i.
+
+typedef std::vector<std::vector<std::string> > SeriesPoints;
+
+template <size_t NSizes, size_t NSeries>
+void run_sized_tests(const size_t (&sizes)[NSizes], size_t max_entries,
+                     const char *const (&names)[NSeries],
+                     void (*measure)(size_t n, SeriesPoints &points))
+{
+    SeriesPoints points(NSeries);
+    for (size_t s = 0; s < NSizes && sizes[s] <= max_entries; s++)
+        measure(sizes[s], points);
+
+    cout << "{\n";
+    for (size_t t = 0; t < NSeries; t++) {
+        cout << "\t\"" << names[t] << "\": [\n";
+        for (size_t i = 0; i < points[t].size(); i++)
+            cout << "\t\t" << points[t][i] << (i < points[t].size() - 1 ? ",\n" : "\n");
+        cout << (t < NSeries - 1 ? "\t],\n" : "\t]\n");
+    }
+    cout << "}" << endl;
+}
+
+
+// === Frozen table test
+//
+// Compare a FrozenTable with an OpenTable holding the same entries. The keys
+// are random with gaps of 1 to 64 between them, like the ids of objects that
+// survived for a while. For tables of 64K, 1M and 8M entries (but no more
+// than max_entries) print [entries, bytes per entry, lookups/second], looking
+// up every key in random order.
+
+template <class Table>
+double time_lookups(const Table &table, const vector<Key> &order, const vector<Value> &expected)
+{
+    double best = 0;
+    for (int trial = 0; trial < 3; trial++) {
+        double t0 = now_seconds();
+        for (size_t i = 0; i < order.size(); i++) {
+            if (table.get(order[i]) != expected[i])
+                abort();
+        }
+        double dt = now_seconds() - t0;
+        if (best == 0 || dt < best)
+            best = dt;
+    }
+    return order.size() / best;
+}
+
+void measure_frozen_tables(size_t n, SeriesPoints &points)
+{
+    vector<Key> keys(n);
+    vector<Value> values(n);
+    uint64_t r = 88172645463325252ull;
+    Key k = 0;
+    for (size_t i = 0; i < n; i++) {
+        k += 1 + xorshift(r) % 64;
+        keys[i] = k;
+        values[i] = xorshift(r);
+    }
+
+    // Look them up in random order, so the FrozenTable doesn't get to
+    // walk its arrays in order.
+    vector<Key> order(keys);
+    vector<Value> expected(values);
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = xorshift(r) % (i + 1);
+        swap(order[i], order[j]);
+        swap(expected[i], expected[j]);
+    }
+
+    ostringstream point;
+    {
+        OpenTable open;
+        for (size_t i = 0; i < n; i++)
+            open.set(keys[i], values[i]);
+        point << "[" << n << ", " << double(open.byte_size(BytesAllocated)) / n << ", "
+              << time_lookups(open, order, expected) << "]";
+        points[0].push_back(point.str());
+    }
+    {
+        FrozenTable frozen(&keys[0], &values[0], n);
+        point.str("");
+        point << "[" << n << ", " << double(frozen.byte_size(BytesAllocated)) / n << ", "
+              << time_lookups(frozen, order, expected) << "]";
+        points[1].push_back(point.str());
+    }
+}
+
+void run_frozen_tests(size_t max_entries)
+{
+    static const size_t sizes[] = {1 << 16, 1 << 20, 1 << 23};
+    static const char *const names[] = {"OpenTable", "FrozenTable"};
+    run_sized_tests(sizes, max_entries, names, measure_frozen_tables);
+}
+
+
+// === Quotient table test
+//
+// Compare a QuotientTable with an OpenTable holding the same random 64-bit
+// keys. For tables of 64K, 1M and 8M entries (but no more than max_entries)
+// print [entries, bytes per entry, hits/second, misses/second], looking up
+// every key in random order and then as many absent keys.
+
+void measure_quotient_tables(size_t n, SeriesPoints &points)
+{
+    vector<Key> keys(n), absent(n);
+    vector<Value> values(n), zeroes(n);
+    uint64_t r = 88172645463325252ull;
+    for (size_t i = 0; i < n; i++) {
+        // Keys are odd and absent keys even, so they never collide. No
+        // absent key is 0, but a key could be -1, the tombstone.
+        do {
+            keys[i] = xorshift(r) | 1;
+        } while (!isLive(keys[i]));
+        absent[i] = (xorshift(r) & ~Key(1)) | 2;
+        values[i] = xorshift(r);
+    }
+    vector<Key> order(keys);
+    vector<Value> expected(values);
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = xorshift(r) % (i + 1);
+        swap(order[i], order[j]);
+        swap(expected[i], expected[j]);
+    }
+
+    ostringstream point;
+    {
+        OpenTable open;
+        for (size_t i = 0; i < n; i++)
+            open.set(keys[i], values[i]);
+        point << "[" << n << ", " << double(open.byte_size(BytesAllocated)) / open.size() << ", "
+              << time_lookups(open, order, expected) << ", "
+              << time_lookups(open, absent, zeroes) << "]";
+        points[0].push_back(point.str());
+    }
+    {
+        QuotientTable quotient;
+        for (size_t i = 0; i < n; i++)
+            quotient.set(keys[i], values[i]);
+        point.str("");
+        point << "[" << n << ", " << double(quotient.byte_size(BytesAllocated)) / quotient.size() << ", "
+              << time_lookups(quotient, order, expected) << ", "
+              << time_lookups(quotient, absent, zeroes) << "]";
+        points[1].push_back(point.str());
+    }
+}
+
+void run_quotient_tests(size_t max_entries)
+{
+    static const size_t sizes[] = {1 << 16, 1 << 20, 1 << 23};
+    static const char *const names[] = {"OpenTable", "QuotientTable"};
+    run_sized_tests(sizes, max_entries, names, measure_quotient_tables);
+}
+
+
+// === Direct table test
+//
+// Compare a DirectTable with an OpenTable and a CloseTable on the keys
+// 1, 2, 3... that the sequential speed tests use. For tables of 64K, 1M and
+// 8M entries (but no more than max_entries) print [entries, bytes per entry,
+// inserts/second, lookups/second], inserting the keys in order into a new
+// table and then looking them all up in random order.
+
+template <class Table>
+void time_sequential_table(size_t n, const vector<Key> &order, std::vector<std::string> &points)
+{
+    double best = 0;
+    size_t bytes = 0;
+    for (int trial = 0; trial < 3; trial++) {
+        double t0 = now_seconds();
+        Table table;
+        for (size_t i = 1; i <= n; i++)
+            table.set(Key(i), Value(i));
+        double rate = n / (now_seconds() - t0);
+        if (rate > best)
+            best = rate;
+        bytes = table.byte_size(BytesAllocated);
+    }
+
+    Table table;
+    for (size_t i = 1; i <= n; i++)
+        table.set(Key(i), Value(i));
+    ostringstream point;
+    point << "[" << n << ", " << double(bytes) / n << ", " << best << ", "
+          << time_lookups(table, order, order) << "]";
+    points.push_back(point.str());
+}
+
+void measure_direct_tables(size_t n, SeriesPoints &points)
+{
+    // Each key's value is the key, so order serves as the expected values.
+    vector<Key> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = Key(i + 1);
+    uint64_t r = 88172645463325252ull;
+    for (size_t i = n - 1; i > 0; i--)
+        swap(order[i], order[xorshift(r) % (i + 1)]);
+
+    time_sequential_table<OpenTable>(n, order, points[0]);
+    time_sequential_table<CloseTable>(n, order, points[1]);
+    time_sequential_table<DirectTable>(n, order, points[2]);
+}
+
+void run_direct_tests(size_t max_entries)
+{
+    static const size_t sizes[] = {1 << 16, 1 << 20, 1 << 23};
+    static const char *const names[] = {"OpenTable", "CloseTable", "DirectTable"};
+    run_sized_tests(sizes, max_entries, names, measure_direct_tables);
+}
+
+
+// === Scale test
+//
+// Insert keys into a single table for as long as it fits in a memory budget.
+// Each time the number of keys doubles, print the insert throughput since the
+// previous checkpoint, the throughput of looking up every key inserted so
+// far, and the bytes allocated per entry.
+//
+// Growing a table briefly needs the old and new arrays at once, so we stop
+// when the next rehash could need more than the budget.
+
+template <class Table>
+void run_scale_test(size_t budget)
+{
+    cout << "[\n";
+
+    Table table;
+    Key k = 1;
+    size_t n = 0;
+    bool first = true;
+    for (size_t checkpoint = 1024; ; checkpoint *= 2) {
+        size_t start = n;
+        double t0 = now_seconds();
+        for (; n < checkpoint; n++) {
+            table.set(k, k);
+            k = k * 1103515245 + 12345;
+        }
+        double insert_dt = now_seconds() - t0;
+
+        t0 = now_seconds();
+        Key j = 1;
+        for (size_t i = 0; i < n; i++) {
+            if (table.get(j) != j)
+                abort();
+            j = j * 1103515245 + 12345;
+        }
+        double lookup_dt = now_seconds() - t0;
+
+        size_t bytes = table.byte_size(BytesAllocated);
+        cout << (first ? "\t\t[" : ",\n\t\t[") << n << ", "
+             << (n - start) / insert_dt << ", "
+             << n / lookup_dt << ", "
+             << double(bytes) / n << "]";
+        cout.flush();
+        first = false;
+
+        if (bytes > budget / 3 || checkpoint > SIZE_MAX / 2)
+            break;
+    }
+
+    cout << "\n\t]";
+}
+
+// Return half of physical memory, or 1GB if we can't tell.
+size_t default_scale_budget()
+{
+#if defined(HAVE_SYSCONF) && defined(_SC_PHYS_PAGES)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && page_size > 0)
+        return size_t(pages) / 2 * size_t(page_size);
+#endif
+    return size_t(1) << 30;
+}
+
+void run_scale_tests(size_t budget)
+{
+    cout << "{" << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_scale_test<OpenTable>(budget);
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_scale_test<CloseTable>(budget);
+    cout << endl;
+
+    cout << "}" << endl;
+}
+
+
+// === Prefetch test
+//
+// Look up every key of a table too big for the cache, in random order, while
+// calling prefetch() on the key `distance` lookups ahead, the way an
+// interpreter that can see a Map access coming might. For each distance
+// (0 means no hints) print [distance, lookups/second]. The best distance
+// shows how much of the latency of a cache-missing lookup hints can hide.
+
+template <class Table>
+void run_prefetch_test(size_t n)
+{
+    vector<Key> keys(n);
+    Table table;
+    Key k = 1;
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = k;
+        table.set(k, k);
+        k = k * 1103515245 + 12345;
+    }
+
+    // Shuffle the keys so that lookups don't walk the entries in order.
+    uint64_t r = 88172645463325252ull;
+    for (size_t i = n - 1; i > 0; i--)
+        swap(keys[i], keys[xorshift(r) % (i + 1)]);
+
+    static const size_t distances[] = {0, 1, 2, 4, 8, 16, 32, 64};
+    const size_t ndistances = sizeof(distances) / sizeof(distances[0]);
+    cout << "[\n";
+    for (size_t d = 0; d < ndistances; d++) {
+        size_t distance = distances[d];
+        double best = 0;
+        for (int trial = 0; trial < 3; trial++) {
+            double t0 = now_seconds();
+            for (size_t i = 0; i < n; i++) {
+                if (distance != 0 && i + distance < n)
+                    table.prefetch(keys[i + distance]);
+                if (table.get(keys[i]) != keys[i])
+                    abort();
+            }
+            double dt = now_seconds() - t0;
+            if (best == 0 || dt < best)
+                best = dt;
+        }
+        cout << (d == 0 ? "\t\t[" : ",\n\t\t[") << distance << ", " << n / best << "]";
+        cout.flush();
+    }
+    cout << "\n\t]";
+}
+
+void run_prefetch_tests(size_t n)
+{
+    cout << "{" << endl;
+
+#ifdef HAVE_SPARSEHASH
+    cout << "\t\"DenseTable\": ";
+    run_prefetch_test<DenseTable>(n);
+    cout << ',' << endl;
+#endif
+
+    cout << "\t\"OpenTable\": ";
+    run_prefetch_test<OpenTable>(n);
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_prefetch_test<CloseTable>(n);
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable (inlined)\": ";
+    run_prefetch_test<inlined::CloseTable>(n);
+    cout << endl;
+
+    cout << "}" << endl;
+}
+
+
+// === Export test
+//
+// Fill a table with n entries, remove some percentage of them at random, and
+// time copying out the rest. A CloseTable keeps removed entries as holes
+// until fewer than 1/4 of its entries are live, so this is the case that
+// keys(), values() and entries() skip holes in bulk for. Print
+// [percent removed, entries/second...] for a Range loop over a CloseTable
+// and for the three methods on each table.
+
+template <class Table>
+void fill_and_thin(Table &table, size_t n, int percent)
+{
+    uint64_t r = 88172645463325252ull;
+    Key k = 1;
+    for (size_t i = 0; i < n; i++) {
+        table.set(k, k);
+        k = k * 1103515245 + 12345;
+    }
+    k = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (xorshift(r) % 100 < uint64_t(percent))
+            table.remove(k);
+        k = k * 1103515245 + 12345;
+    }
+}
+
+template <class Table, class Out>
+double export_rate(const Table &table, size_t (Table::*method)(Out *) const)
+{
+    vector<Out> out(table.size() + 1);
+    double best = 0;
+    for (int trial = 0; trial < 5; trial++) {
+        double t0 = now_seconds();
+        size_t n = (table.*method)(&out[0]);
+        double dt = now_seconds() - t0;
+        if (n != table.size())
+            abort();
+        if (best == 0 || dt < best)
+            best = dt;
+    }
+    return table.size() / best;
+}
+
+double range_export_rate(CloseTable &table)
+{
+    vector<Key> out(table.size() + 1);
+    double best = 0;
+    for (int trial = 0; trial < 5; trial++) {
+        double t0 = now_seconds();
+        size_t n = 0;
+        for (CloseTable::Range r(table); !r.empty(); r.popFront())
+            out[n++] = r.front_key();
+        double dt = now_seconds() - t0;
+        if (n != table.size())
+            abort();
+        if (best == 0 || dt < best)
+            best = dt;
+    }
+    return table.size() / best;
+}
+
+void run_export_tests(size_t n)
+{
+    static const int percents[] = {0, 10, 25, 50, 70};
+    const size_t npercents = sizeof(percents) / sizeof(percents[0]);
+
+    cout << "{\n\t\"CloseTable\": [\n";
+    for (size_t p = 0; p < npercents; p++) {
+        CloseTable table;
+        fill_and_thin(table, n, percents[p]);
+        cout << (p == 0 ? "\t\t[" : ",\n\t\t[") << percents[p]
+             << ", " << range_export_rate(table)
+             << ", " << export_rate(table, &CloseTable::keys)
+             << ", " << export_rate(table, &CloseTable::values)
+             << ", " << export_rate(table, &CloseTable::entries) << "]";
+        cout.flush();
+    }
+    cout << "\n\t],\n\t\"OpenTable\": [\n";
+    for (size_t p = 0; p < npercents; p++) {
+        OpenTable table;
+        fill_and_thin(table, n, percents[p]);
+        cout << (p == 0 ? "\t\t[" : ",\n\t\t[") << percents[p]
+             << ", " << export_rate(table, &OpenTable::keys)
+             << ", " << export_rate(table, &OpenTable::values)
+             << ", " << export_rate(table, &OpenTable::entries) << "]";
+        cout.flush();
+    }
+    cout << "\n\t]\n}" << endl;
+}
+
+
+// === Card marking test
+//
+// A generational GC's minor collection has to visit every pointer from the
+// old generation into the young one. If each write to a table just puts the
+// whole table in the remembered set, the minor GC scans all of it, however
+// few of its entries changed; with cards enabled, it scans only the cards
+// written since the last one. For tables of 64K, 1M and 4M entries (but no
+// more than max_entries), each round overwrites 0.1% of the values at
+// random with "young pointers" (odd values) and then runs a minor GC, on one
+// table with cards and on a copy without. Print [entries, fraction of cards
+// dirty, seconds per whole-table scan, seconds per dirty-card scan,
+// sets/second without cards, sets/second with cards], the last two for
+// overwriting every entry in random order.
+
+// The minor GC on a table with cards: count the young pointers and promote
+// them (clear the low bit), as a copying collector would update a pointer to
+// an object it moved.
+struct PromoteYoung {
+    size_t young;
+    void operator()(Key, Value &v) {
+        young += v & 1;
+        v &= ~Value(1);
+    }
+};
+
+// The minor GC on a whole table. scan_slots passes values by copy, so this
+// only counts them; the cost is in finding them.
+struct CountYoung {
+    size_t young;
+    void operator()(Key, Value v) { young += v & 1; }
+};
+
+template <class Table>
+double overwrite_rate(Table &table, const vector<Key> &order)
+{
+    double best = 0;
+    for (int trial = 0; trial < 3; trial++) {
+        double t0 = now_seconds();
+        for (size_t i = 0; i < order.size(); i++)
+            table.set(order[i], Value(i) << 1);
+        double rate = order.size() / (now_seconds() - t0);
+        if (rate > best)
+            best = rate;
+    }
+    return best;
+}
+
+template <class Table>
+void run_card_test(size_t n, std::vector<std::string> &points)
+{
+    uint64_t r = 88172645463325252ull;
+    vector<Key> keys(n);
+    Table carded, plain;
+    for (size_t i = 0; i < n; i++) {
+        Key k;
+        do {
+            k = xorshift(r);
+        } while (!isLive(k));
+        keys[i] = k;
+        carded.set(k, Value(i) << 1);
+        plain.set(k, Value(i) << 1);
+    }
+    carded.enable_cards();
+
+    size_t mutations = n / 1000;
+    size_t rounds = max(size_t(10), (size_t(1) << 26) / n);
+    size_t dirty = 0;
+    double whole_seconds = 0, dirty_seconds = 0;
+    vector<Key> mutated(mutations);
+    for (size_t round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < mutations; i++) {
+            Key k = keys[xorshift(r) % n];
+            Value v = (xorshift(r) << 1) | 1;
+            carded.set(k, v);
+            plain.set(k, v);
+            mutated[i] = k;
+        }
+
+        double t0 = now_seconds();
+        CountYoung count = {0};
+        plain.scan_slots(0, plain.slot_count(), count);
+        double t1 = now_seconds();
+        PromoteYoung promote = {0};
+        dirty += carded.scan_dirty_cards(promote);
+        double t2 = now_seconds();
+        whole_seconds += t1 - t0;
+        dirty_seconds += t2 - t1;
+
+        // Every young pointer written this round, and no other, is found.
+        sort(mutated.begin(), mutated.end());
+        size_t distinct = unique(mutated.begin(), mutated.end()) - mutated.begin();
+        if (promote.young != distinct || count.young < distinct)
+            abort();
+    }
+    size_t cards = (carded.slot_count() + CardSlots - 1) / CardSlots;
+
+    double plain_rate = overwrite_rate(plain, keys);
+    double carded_rate = overwrite_rate(carded, keys);
+    ostringstream point;
+    point << "[" << n << ", " << double(dirty) / rounds / cards << ", "
+          << whole_seconds / rounds << ", " << dirty_seconds / rounds << ", "
+          << plain_rate << ", " << carded_rate << "]";
+    points.push_back(point.str());
+}
+
+void measure_card_tables(size_t n, SeriesPoints &points)
+{
+    run_card_test<OpenTable>(n, points[0]);
+    run_card_test<CloseTable>(n, points[1]);
+}
+
+void run_card_tests(size_t max_entries)
+{
+    static const size_t sizes[] = {1 << 16, 1 << 20, 1 << 22};
+    static const char *const names[] = {"OpenTable", "CloseTable"};
+    run_sized_tests(sizes, max_entries, names, measure_card_tables);
+}
+
+
+// === Serialization test
+//
+// Send a CloseTable to another process, as structured clone or IPC would,
+// and compare its wire format with the naive way: iterate with a Range,
+// writing each key and value as 16 raw bytes, and read them back with set()
+// into a new table. For tables of 64K, 1M and 4M entries (but no more than
+// max_entries), with the keys 1, 2, 3... and with random keys, print
+// [entries, wire bytes per entry, naive serialize MB/s, serialize MB/s,
+// naive deserialize MB/s, deserialize MB/s]. MB/s counts 16 bytes per entry
+// (a key and a value) whatever the encoding, so the rates compare directly.
+
+struct BufferSink {
+    unsigned char *p;
+    void write(const unsigned char *bytes, size_t n) {
+        memcpy(p, bytes, n);
+        p += n;
+    }
+};
+
+void run_serialize_test(size_t n, bool random_keys, std::vector<std::string> &points)
+{
+    uint64_t r = 88172645463325252ull;
+    CloseTable table;
+    for (size_t i = 0; i < n; i++) {
+        Key k = Key(i + 1);
+        if (random_keys) {
+            do {
+                k = xorshift(r);
+            } while (!isLive(k));
+        }
+        table.set(k, Value(i));
+    }
+
+    vector<unsigned char> raw(n * 16 + 1), wire(n * 2 * MaxVarintBytes + MaxVarintBytes);
+    size_t wire_bytes = 0;
+    double naive_out = 0, out = 0, naive_in = 0, in = 0;
+    for (int trial = 0; trial < 3; trial++) {
+        double t0 = now_seconds();
+        unsigned char *p = &raw[0];
+        for (CloseTable::Range range(table); !range.empty(); range.popFront()) {
+            Key k = range.front_key();
+            Value v = range.front_value();
+            memcpy(p, &k, sizeof k);
+            memcpy(p + 8, &v, sizeof v);
+            p += 16;
+        }
+        double t1 = now_seconds();
+        BufferSink sink = {&wire[0]};
+        table.serialize(sink);
+        double t2 = now_seconds();
+        wire_bytes = sink.p - &wire[0];
+
+        CloseTable *naive = new CloseTable;
+        double t3 = now_seconds();
+        for (p = &raw[0]; p != &raw[0] + n * 16; p += 16) {
+            Key k;
+            Value v;
+            memcpy(&k, p, sizeof k);
+            memcpy(&v, p + 8, sizeof v);
+            naive->set(k, v);
+        }
+        double t4 = now_seconds();
+        CloseTable *copy = new CloseTable;
+        double t5 = now_seconds();
+        bool ok = copy->deserialize(&wire[0], wire_bytes);
+        double t6 = now_seconds();
+
+        vector<KeyValue> expected(n + 1), actual(n + 1);
+        table.entries(&expected[0]);
+        if (!ok || naive->size() != n || copy->entries(&actual[0]) != n)
+            abort();
+        for (size_t i = 0; i < n; i++) {
+            if (actual[i].key != expected[i].key || actual[i].value != expected[i].value)
+                abort();
+        }
+        delete naive;
+        delete copy;
+
+        double mb = n * 16 / 1e6;
+        naive_out = max(naive_out, mb / (t1 - t0));
+        out = max(out, mb / (t2 - t1));
+        naive_in = max(naive_in, mb / (t4 - t3));
+        in = max(in, mb / (t6 - t5));
+    }
+
+    ostringstream point;
+    point << "[" << n << ", " << double(wire_bytes) / n << ", " << naive_out << ", " << out
+          << ", " << naive_in << ", " << in << "]";
+    points.push_back(point.str());
+}
+
+void measure_serialization(size_t n, SeriesPoints &points)
+{
+    run_serialize_test(n, false, points[0]);
+    run_serialize_test(n, true, points[1]);
+}
+
+void run_serialize_tests(size_t max_entries)
+{
+    static const size_t sizes[] = {1 << 16, 1 << 20, 1 << 22};
+    static const char *const names[] = {"Sequential keys", "Random keys"};
+    run_sized_tests(sizes, max_entries, names, measure_serialization);
+}
+
+
+// === Hashed key test
+//
+// Count occurrences of keys, the way a program does with a Map:
+//     map.set(k, map.has(k) ? map.get(k) + 1 : 1);
+// That hashes k three times. With a HashedKey it hashes it once. To make the
+// difference show, this uses copies of the tables whose hash function costs
+// about as much as hashing a short string.
+
+namespace slowhash {
+
+// FNV-1a over 32 bytes: the key's 8 bytes, four times over. That's about
+// what hashing a typical identifier costs. The empty volatile asm keeps the
+// compiler from seeing that three calls with the same key give the same
+// result and computing it once. It couldn't do that for a real string hash
+// either, since a string lives in memory and set() writes to memory.
+inline hashcode_t hash(KeyArg k)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < 32; i++) {
+        h ^= (k >> (i % 8 * 8)) & 0xff;
+        h *= 0x100000001b3ull;
+    }
+#ifdef __GNUC__
+    __asm__ __volatile__("" : "+r"(h));
+#endif
+    return hashcode_t(h);
+}
+
+#define TABLES_INLINE inline
+#define TABLES_COLD inline
+#include "tables-core.h"
+#include "tables-core-inl.h"
+#undef TABLES_INLINE
+#undef TABLES_COLD
+
+}  // namespace slowhash
+
+template <class Table>
+struct HasThenSetTest : GoodTest {
+    enum { Size = 1000 };
+    Table table;
+
+    void setup(size_t) {}
+
+    void run(size_t n) {
+        Key k = 1;
+        for (size_t i = 0; i < n; i++) {
+            table.set(k, table.has(k) ? table.get(k) + 1 : 1);
+            k = k % Size + 1;
+        }
+    }
+};
+
+template <class Table>
+struct HashedHasThenSetTest : GoodTest {
+    enum { Size = 1000 };
+    Table table;
+
+    void setup(size_t) {}
+
+    void run(size_t n) {
+        Key k = 1;
+        for (size_t i = 0; i < n; i++) {
+            HashedKey hk = table.hashed(k);
+            table.set(hk, table.has(hk) ? table.get(hk) + 1 : 1);
+            k = k % Size + 1;
+        }
+    }
+};
+
+void run_hashed_key_tests()
+{
+    cout << "{\n\"HasThenSetTest\": {" << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_time_trials<HasThenSetTest<slowhash::OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable (hashed once)\": ";
+    run_time_trials<HashedHasThenSetTest<slowhash::OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<HasThenSetTest<slowhash::CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable (hashed once)\": ";
+    run_time_trials<HashedHasThenSetTest<slowhash::CloseTable> >();
+    cout << endl;
+
+    cout << "}\n}" << endl;
+}
+
+
+// === Handle test
+//
+// A runtime often looks a key up once and then reads and writes its value
+// many times. For each key in turn, in random order, this does that Repeats
+// times: once through the table with the key (get, then set), and once
+// through a handle from find() (get_by_handle, then set_by_handle). For
+// tables of 1,000 and 1M entries print [entries, keyed operations/second,
+// handle operations/second], counting each get and set as one operation,
+// for CloseTable, its inlined copy from tables-inline.h and the slow-hash
+// copy from the hashed key test.
+
+template <class Table>
+void run_handle_test(const char *name, bool last)
+{
+    const size_t Repeats = 8;
+    static const size_t sizes[] = {1000, 1000000};
+    const size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    cout << "\t\"" << name << "\": [\n";
+    for (size_t s = 0; s < nsizes; s++) {
+        size_t n = sizes[s];
+        Table table;
+        vector<Key> order(n);
+        for (size_t i = 0; i < n; i++) {
+            order[i] = Key(i + 1) * 0x9e3779b97f4a7c15ull >> 1;
+            table.set(order[i], 0);
+        }
+        uint64_t r = 88172645463325252ull;
+        for (size_t i = n - 1; i > 0; i--)
+            swap(order[i], order[xorshift(r) % (i + 1)]);
+
+        double rates[2];
+        for (int by_handle = 0; by_handle < 2; by_handle++) {
+            size_t ops = 0;
+            double t0 = now_seconds(), dt;
+            do {
+                for (size_t i = 0; i < n; i++) {
+                    Key k = opaque(order[i]);
+                    if (by_handle) {
+                        EntryHandle h = table.find(k);
+                        for (size_t j = 0; j < Repeats; j++) {
+                            Value v;
+                            if (!table.get_by_handle(h, &v) || !table.set_by_handle(h, opaque(v) + 1))
+                                abort();
+                        }
+                    } else {
+                        for (size_t j = 0; j < Repeats; j++)
+                            table.set(k, opaque(table.get(k)) + 1);
+                    }
+                }
+                ops += n * Repeats * 2;
+                dt = now_seconds() - t0;
+            } while (dt < 0.2);
+            rates[by_handle] = ops / dt;
+        }
+        cout << "\t\t[" << n << ", " << rates[0] << ", " << rates[1]
+             << (s < nsizes - 1 ? "],\n" : "]\n");
+    }
+    cout << (last ? "\t]\n" : "\t],\n");
+}
+
+void run_handle_tests()
+{
+    cout << "{\n";
+    run_handle_test<CloseTable>("CloseTable", false);
+    run_handle_test<inlined::CloseTable>("CloseTable (inlined)", false);
+    run_handle_test<slowhash::CloseTable>("CloseTable (slow hash)", true);
+    cout << "}" << endl;
+}
+
+
+#ifdef HAVE_PHASE_TIMING
+// === Cycle attribution
+//
+// Only in builds with -DHAVE_PHASE_TIMING (see tables.h). Run each speed test
+// once on each table, at a size that takes about a quarter of a second in
+// this build, and split the cycles the run took into the phases the tables
+// count, per operation (per iteration of the test's loop). "other" is
+// everything outside the phases, mostly the test's own loop. The cost of a
+// reading, measured first, is taken off wherever readings were taken. The
+// slow-hash copies from the hashed key test show what the split looks like
+// when hashing costs as much as a short string's.
+
+// Cycles for one phase_lap() with nothing to time.
+double phase_reading_cycles()
+{
+    PhaseCounters saved = phase_counters;
+    double best = 0;
+    for (int trial = 0; trial < 5; trial++) {
+        const int Laps = 100000;
+        uint64_t t = phase_clock(), t0 = t;
+        for (int i = 0; i < Laps; i++)
+            phase_lap(t, PhaseHash);
+        double c = double(t - t0) / Laps;
+        if (trial == 0 || c < best)
+            best = c;
+    }
+    phase_counters = saved;
+    return best;
+}
+
+template <class Test>
+void run_phase_trial(double reading)
+{
+    size_t n = size_t(ceil(estimate_speed<Test>() * 0.25));
+    Test test;
+    test.setup(n);
+    memset(&phase_counters, 0, sizeof(phase_counters));
+    uint64_t t0 = phase_clock();
+    test.run(n);
+    uint64_t total = phase_clock() - t0;
+
+    double other = double(total) - phase_counters.starts * reading;
+    cout << "[";
+    for (int p = 0; p < PhaseCount; p++) {
+        double c = double(phase_counters.cycles[p]);
+        other -= c;
+        c -= phase_counters.laps[p] * reading;
+        cout << (c > 0 ? c / n : 0) << ", ";
+    }
+    cout << (other > 0 ? other / n : 0) << "]";
+}
+
+template <template <class> class Test>
+void run_ordered_phase_test(double reading)
+{
+    cout << "{\n\t\"CloseTable\": ";
+    run_phase_trial<Test<CloseTable> >(reading);
+    cout << ",\n\t\"CloseTable (slow hash)\": ";
+    run_phase_trial<Test<slowhash::CloseTable> >(reading);
+    cout << "\n}";
+}
+
+template <template <class> class Test>
+void run_phase_test(double reading)
+{
+    cout << "{\n\t\"OpenTable\": ";
+    run_phase_trial<Test<OpenTable> >(reading);
+    cout << ",\n\t\"OpenTable (slow hash)\": ";
+    run_phase_trial<Test<slowhash::OpenTable> >(reading);
+    cout << ",\n\t\"CloseTable\": ";
+    run_phase_trial<Test<CloseTable> >(reading);
+    cout << ",\n\t\"CloseTable (slow hash)\": ";
+    run_phase_trial<Test<slowhash::CloseTable> >(reading);
+    cout << "\n}";
+}
+
+void run_phase_tests(const char *name)
+{
+    double reading = phase_reading_cycles();
+    cout << "{\n\"phases\": [\"hash\", \"probe\", \"compare\", \"value\", \"rehash\", \"other\"],\n"
+         << "\"reading\": " << reading;
+
+#define RUN_PHASES(Test, runner) \
+    if (!name || strcmp(name, #Test) == 0) { \
+        cout << ",\n\"" #Test "\": "; \
+        runner<Test>(reading); \
+    }
+#define RUN_UNORDERED(Test) RUN_PHASES(Test, run_phase_test)
+#define RUN_ORDERED(Test) RUN_PHASES(Test, run_ordered_phase_test)
+    FOR_EACH_SPEED_TEST(RUN_UNORDERED)
+    FOR_EACH_ORDERED_SPEED_TEST(RUN_ORDERED)
+#undef RUN_ORDERED
+#undef RUN_UNORDERED
+#undef RUN_PHASES
+
+    cout << "\n}" << endl;
+}
+#endif  // HAVE_PHASE_TIMING
+
+
+// === Probe overhead check
+//
+// Two copies of the tables, compiled the same way, one with the USDT probes
+// (see tables.h) and one with TABLES_PROBE_ENABLED forced to false and the
+// probes themselves defined away, which leaves no probe code behind, not
+// even the semaphore checks. With no tracer attached, the probes should
+// cost no more than the noise between runs. For
+// several speed tests, each round times the probed copy and the unprobed
+// copy twice, in alternating order. The median of probed / unprobed, less 1,
+// is the overhead; the ratio of the two unprobed runs is what the same code
+// measures against itself, and the bigger distance of its quartiles from 1
+// is the noise. Print [overhead, noise] for each test, and fail if any
+// overhead exceeds the noise (or 2%, whichever is more).
+//
+// Build with -DHAVE_SDT for this to mean anything; otherwise the copies are
+// the same.
+
+#define TABLES_INLINE inline
+#define TABLES_COLD inline
+namespace probed {
+// This file says "using namespace std", so hash() needs pinning down.
+using ::hash;
+#include "tables-core.h"
+#include "tables-core-inl.h"
+}  // namespace probed
+
+#pragma push_macro("TABLES_PROBE_ENABLED")
+#pragma push_macro("TABLES_PROBE2")
+#pragma push_macro("TABLES_PROBE4")
+#undef TABLES_PROBE_ENABLED
+#undef TABLES_PROBE2
+#undef TABLES_PROBE4
+#define TABLES_PROBE_ENABLED(name) false
+#define TABLES_PROBE2(name, a, b) ((void) (a), (void) (b))
+#define TABLES_PROBE4(name, a, b, c, d) ((void) (a), (void) (b), (void) (c), (void) (d))
+namespace unprobed {
+using ::hash;
+#include "tables-core.h"
+#include "tables-core-inl.h"
+}  // namespace unprobed
+#pragma pop_macro("TABLES_PROBE4")
+#pragma pop_macro("TABLES_PROBE2")
+#pragma pop_macro("TABLES_PROBE_ENABLED")
+#undef TABLES_INLINE
+#undef TABLES_COLD
+
+template <template <class> class Test, class Probed, class Unprobed>
+bool check_probe_overhead(const char *name)
+{
+    const int rounds = 15;
+    size_t n = size_t(ceil(estimate_speed<Test<Unprobed> >() * 0.05));
+    vector<double> ratios(rounds), controls(rounds);
+    for (int i = 0; i < rounds; i++) {
+        double with, without, again;
+        if (i % 2 == 0) {
+            with = measure_single_run<Test<Probed> >(n);
+            without = measure_single_run<Test<Unprobed> >(n);
+            again = measure_single_run<Test<Unprobed> >(n);
+        } else {
+            without = measure_single_run<Test<Unprobed> >(n);
+            again = measure_single_run<Test<Unprobed> >(n);
+            with = measure_single_run<Test<Probed> >(n);
+        }
+        ratios[i] = with / without;
+        controls[i] = again / without;
+    }
+    sort(ratios.begin(), ratios.end());
+    sort(controls.begin(), controls.end());
+    double overhead = ratios[rounds / 2] - 1;
+    double noise = max(controls[rounds * 3 / 4] - 1, 1 - controls[rounds / 4]);
+    cout << "\t\"" << name << "\": [" << overhead << ", " << noise << "]," << endl;
+    return overhead <= max(noise, 0.02);
+}
+
+template <template <class> class Test>
+bool check_probe_overheads(const char *test)
+{
+    string open = string("OpenTable ") + test, close = string("CloseTable ") + test;
+    bool ok = check_probe_overhead<Test, probed::OpenTable, unprobed::OpenTable>(open.c_str());
+    return check_probe_overhead<Test, probed::CloseTable, unprobed::CloseTable>(close.c_str()) && ok;
+}
+
+bool run_probe_overhead_check()
+{
+#ifndef HAVE_SDT
+    cerr << "note: built without -DHAVE_SDT, so there are no probes to measure" << endl;
+#endif
+    cout << "{" << endl;
+    bool ok = check_probe_overheads<InsertSmallTest>("InsertSmallTest");
+    ok = check_probe_overheads<LookupHitTest>("LookupHitTest") && ok;
+    ok = check_probe_overheads<LookupMissTest>("LookupMissTest") && ok;
+    ok = check_probe_overheads<WorklistTest>("WorklistTest") && ok;
+    ok = check_probe_overheads<DeleteTest>("DeleteTest") && ok;
+    cout << "\t\"ok\": " << (ok ? "true" : "false") << "\n}" << endl;
+    return ok;
+}
+
+
+// === Small tables test
+//
+// Build 100,000 tables with the same keys, added in the same order, as a
+// program does with record-like Maps. Then look up every key in every table,
+// over and over. For each table type and number of keys, print [keys, bytes
+// per table, lookups/second]. For ShapeTable the bytes include a share of the
+// shapes, which all the tables use.
+
+template <class Table>
+size_t shared_bytes(const Table *) { return 0; }
+
+size_t shared_bytes(const ShapeTable *) { return ShapeTable::Tree::shared().byte_size(); }
+
+template <class Table>
+void run_small_tables_test()
+{
+    const size_t Count = 100000;
+    static const size_t key_counts[] = {2, 4, 8, 16};
+    const size_t nkey_counts = sizeof(key_counts) / sizeof(key_counts[0]);
+
+    cout << "[\n";
+    for (size_t c = 0; c < nkey_counts; c++) {
+        size_t keys = key_counts[c];
+        Table *tables = new Table[Count];
+        for (size_t t = 0; t < Count; t++) {
+            for (size_t k = 0; k < keys; k++)
+                tables[t].set(0x1000 + 8 * k, t + k);
+        }
+
+        size_t bytes = shared_bytes(tables);
+        for (size_t t = 0; t < Count; t++)
+            bytes += tables[t].byte_size(BytesAllocated);
+
+        size_t lookups = 0;
+        double t0 = now_seconds(), dt;
+        do {
+            for (size_t t = 0; t < Count; t++) {
+                for (size_t k = 0; k < keys; k++) {
+                    if (tables[t].get(0x1000 + 8 * k) != t + k)
+                        abort();
+                }
+            }
+            lookups += Count * keys;
+            dt = now_seconds() - t0;
+        } while (dt < 0.2);
+        delete[] tables;
+
+        cout << "\t\t[" << keys << ", " << double(bytes) / Count << ", " << lookups / dt
+             << (c < nkey_counts - 1 ? "]," : "]") << endl;
+    }
+    cout << "\t]";
+}
+
+void run_small_tables_tests()
+{
+    cout << "{" << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_small_tables_test<OpenTable>();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_small_tables_test<CloseTable>();
+    cout << ',' << endl;
+
+    cout << "\t\"PackedCloseTable\": ";
+    run_small_tables_test<PackedCloseTable>();
+    cout << ',' << endl;
+
+    cout << "\t\"ShapeTable\": ";
+    run_small_tables_test<ShapeTable>();
+    cout << endl;
+
+    cout << "}" << endl;
+}
+
+
+// === Cold tables test
+//
+// Age a heap of FreezableTables the way a long-running program ages its Maps.
+// Each table gets a random number of entries (exponentially distributed,
+// median 100) and loses about a fifth of them again; then it keeps being
+// written to for a random number of rounds (again exponential, median 4)
+// and is left alone after that. A FreezePolicy sweeps after every round.
+// An identical set of tables with no policy is the control. For each round
+// print [round, frozen tables, bytes, control bytes]. Then print lookup
+// speed in the frozen and control tables, and finally write once to every
+// frozen table and print what thawing cost: [tables, entries, seconds per
+// table, nanoseconds per entry].
+
+static size_t exponential(uint64_t &r, double median)
+{
+    double u = (double(xorshift(r) >> 11) + 0.5) / double(uint64_t(1) << 53);
+    return size_t(-log(u) * median / log(2.0));
+}
+
+void run_cold_tables_test(size_t count)
+{
+    const size_t Rounds = 16;
+    FreezePolicy policy;
+    FreezableTable **tables = new FreezableTable *[count];
+    FreezableTable **control = new FreezableTable *[count];
+    vector<size_t> hot_until(count);
+    uint64_t r = 88172645463325252ull;
+    for (size_t t = 0; t < count; t++) {
+        tables[t] = new FreezableTable(&policy);
+        control[t] = new FreezableTable;
+        size_t n = exponential(r, 100);
+        for (size_t i = 0; i < n; i++) {
+            Key k = xorshift(r) | 1;
+            tables[t]->set(k, i);
+            control[t]->set(k, i);
+            if (xorshift(r) % 5 == 0) {
+                tables[t]->remove(k);
+                control[t]->remove(k);
+            }
+        }
+        hot_until[t] = exponential(r, 4);
+    }
+
+    vector<Key> keys;
+    cout << "{\n\t\"rounds\": [\n";
+    for (size_t round = 1; round <= Rounds; round++) {
+        for (size_t t = 0; t < count; t++) {
+            if (round > hot_until[t])
+                continue;
+            // Replace an entry, or add one if the table is empty.
+            keys.resize(control[t]->size() + 1);
+            keys.resize(control[t]->keys(&keys[0]));
+            Key k = xorshift(r) | 1;
+            tables[t]->set(k, round);
+            control[t]->set(k, round);
+            if (!keys.empty()) {
+                Key old = keys[xorshift(r) % keys.size()];
+                tables[t]->remove(old);
+                control[t]->remove(old);
+            }
+        }
+        policy.sweep();
+
+        size_t frozen = 0, bytes = 0, control_bytes = 0;
+        for (size_t t = 0; t < count; t++) {
+            frozen += tables[t]->is_frozen();
+            bytes += tables[t]->byte_size(BytesAllocated);
+            control_bytes += control[t]->byte_size(BytesAllocated);
+        }
+        cout << "\t\t[" << round << ", " << frozen << ", " << bytes << ", " << control_bytes
+             << (round < Rounds ? "],\n" : "]\n");
+    }
+    cout << "\t],\n";
+
+    // Look up every key of every table, in table order, in both sets.
+    vector<KeyValue> all;
+    vector<size_t> owner;
+    for (size_t t = 0; t < count; t++) {
+        size_t n = control[t]->size();
+        all.resize(all.size() + n + 1);
+        all.resize(all.size() - n - 1 + control[t]->entries(&all[all.size() - n - 1]));
+        owner.resize(all.size(), t);
+    }
+    double rates[2];
+    for (int which = 0; which < 2; which++) {
+        FreezableTable **group = which == 0 ? control : tables;
+        size_t lookups = 0;
+        double t0 = now_seconds(), dt;
+        do {
+            for (size_t i = 0; i < all.size(); i++) {
+                if (group[owner[i]]->get(opaque(all[i].key)) != all[i].value)
+                    abort();
+            }
+            lookups += all.size();
+            dt = now_seconds() - t0;
+        } while (dt < 0.2);
+        rates[which] = lookups / dt;
+    }
+    cout << "\t\"lookups\": [" << rates[0] << ", " << rates[1] << "],\n";
+
+    size_t thawed = 0, entries = 0;
+    double t0 = now_seconds();
+    for (size_t t = 0; t < count; t++) {
+        if (tables[t]->is_frozen()) {
+            thawed++;
+            entries += tables[t]->size();
+            tables[t]->set(1, 0);
+        }
+    }
+    double dt = now_seconds() - t0;
+    cout << "\t\"thaw\": [" << thawed << ", " << entries << ", " << (thawed ? dt / thawed : 0) << ", "
+         << (entries ? dt * 1e9 / entries : 0) << "]\n}" << endl;
+
+    for (size_t t = 0; t < count; t++) {
+        delete tables[t];
+        delete control[t];
+    }
+    delete[] tables;
+    delete[] control;
+}
+
+
+// === Memory budget test
+//
+// Build 2,000 budgeted tables, half OpenTables and half CloseTables, with
+// sizes drawn from an exponential distribution (median 500), and remove 60%
+// of the entries of each: the slack a long-running heap collects. Then grow
+// one more CloseTable by 2M entries, in batches of 4,096, timing each batch.
+// Do all this twice, first with no limit and then with a limit 10% over the
+// heap's size when the growth starts, so that the budget is hit partway
+// through. Print [limit, bytes before growing, peak bytes, final bytes,
+// seconds, slowest batch in seconds, reclaim passes, bytes reclaimed] for
+// each run, sampling the byte total after every batch.
+
+static void run_budget_trial(bool limited)
+{
+    const size_t Tables = 2000, Growth = 2000000, Batch = 4096;
+    MemoryBudget budget(SIZE_MAX);
+    std::vector<BudgetedTableBase *> tables;
+    uint64_t r = 88172645463325252ull;
+    for (size_t t = 0; t < Tables; t++) {
+        size_t n = exponential(r, 500);
+        if (t % 2) {
+            Budgeted<CloseTable> *table = new Budgeted<CloseTable>(&budget);
+            for (size_t i = 1; i <= n; i++)
+                table->set(i, i);
+            for (size_t i = 1; i <= n; i++) {
+                if (xorshift(r) % 5 < 3)
+                    table->remove(i);
+            }
+            tables.push_back(table);
+        } else {
+            Budgeted<OpenTable> *table = new Budgeted<OpenTable>(&budget);
+            for (size_t i = 1; i <= n; i++)
+                table->set(i, i);
+            for (size_t i = 1; i <= n; i++) {
+                if (xorshift(r) % 5 < 3)
+                    table->remove(i);
+            }
+            tables.push_back(table);
+        }
+    }
+
+    size_t before = budget.total_bytes();
+    size_t limit = limited ? before + before / 10 : SIZE_MAX;
+    budget.set_limit_bytes(limit);
+    size_t peak = before;
+    double slowest = 0;
+    Budgeted<CloseTable> *growing = new Budgeted<CloseTable>(&budget);
+    double t0 = now_seconds();
+    for (size_t done = 0; done < Growth; done += Batch) {
+        double b0 = now_seconds();
+        for (size_t i = done; i < done + Batch; i++)
+            growing->set(Key(i + 1), Value(i));
+        double dt = now_seconds() - b0;
+        if (dt > slowest)
+            slowest = dt;
+        if (budget.total_bytes() > peak)
+            peak = budget.total_bytes();
+    }
+    double seconds = now_seconds() - t0;
+
+    cout << "[" << (limited ? limit : 0) << ", " << before << ", " << peak << ", "
+         << budget.total_bytes() << ", " << seconds << ", " << slowest << ", "
+         << budget.reclaim_passes() << ", " << budget.reclaimed_bytes() << "]";
+
+    delete growing;
+    for (size_t t = 0; t < tables.size(); t++)
+        delete tables[t];
+}
+
+void run_budget_tests()
+{
+    cout << "{\n\t\"no limit\": ";
+    run_budget_trial(false);
+    cout << ",\n\t\"limit\": ";
+    run_budget_trial(true);
+    cout << "\n}" << endl;
+}
+
+
+#ifdef HAVE_MMAP
+// === Out-of-core test
+//
+// Build MmapTables of increasing size and time random lookups in each one,
+// while limiting how much of the table may be resident: after every
+// `resident` bytes' worth of lookups (counting one page per lookup), all of
+// the table's pages are dropped from memory, page cache included (see
+// MmapTable::release_resident). Once the table is much bigger than the
+// resident limit, nearly every lookup faults and reads its page from disk.
+//
+// Print [entries, table bytes, lookups/second] for each size.
+
+// Churn a two-page MmapTable until every page has overflowed into the other:
+// fill it, remove down to the shrink threshold, then refill with new keys.
+// Lookups of absent keys must still end, and everything must still be found.
+void check_mmap_overflow()
+{
+    MmapTable table;
+    for (Key k = 2; k <= 2 * 237; k += 2)
+        table.set(k, k);
+    for (Key k = 2; table.size() > 118; k += 2)
+        table.remove(k);
+    for (Key k = 1; table.size() < 354; k += 2)
+        table.set(k, k);
+    for (Key k = 1; k <= 2 * 237; k++) {
+        Value v = table.get(k);
+        if (v != 0 && v != k)
+            abort();
+    }
+    if (table.has(Key(1) << 40))
+        abort();
+    table.set(Key(1) << 40, 1);
+    if (table.get(Key(1) << 40) != 1 || table.size() != 355)
+        abort();
+}
+
+void run_out_of_core_test(size_t resident, size_t max_bytes)
+{
+    check_mmap_overflow();
+
+    const size_t lookups = 1 << 20;
+    const size_t pages_per_release = resident / 4096 ? resident / 4096 : 1;
+    const Key K = 0x9E3779B97F4A7C15ULL;  // any odd number; keys are i * K
+
+    cout << "[\n";
+    bool first = true;
+    for (size_t n = 1 << 16; ; n *= 2) {
+        MmapTable table;
+        for (size_t i = 1; i <= n; i++)
+            table.set(i * K, i);
+        size_t bytes = table.byte_size(BytesAllocated);
+        table.release_resident();
+
+        uint64_t x = 88172645463325252ULL;
+        double t0 = now_seconds();
+        for (size_t i = 0; i < lookups; i++) {
+            if (i % pages_per_release == 0)
+                table.release_resident();
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            size_t j = x % n + 1;
+            if (table.get(j * K) != j)
+                abort();
+        }
+        double dt = now_seconds() - t0;
+
+        cout << (first ? "\t[" : ",\n\t[") << n << ", " << bytes << ", " << lookups / dt << "]";
+        cout.flush();
+        first = false;
+        if (bytes * 2 > max_bytes)
+            break;
+    }
+    cout << "\n]" << endl;
+}
+#endif  // HAVE_MMAP
+
+
+// === Shrink test
+//
+// Grow a big table, remove nearly everything from it, and see whether the
+// process's resident memory goes back down. For each table print
+// [RSS before, RSS when full, RSS after removing, table byte_size after
+// removing], in bytes.
+
+// Return the resident set size of this process in bytes, or 0 if we can't
+// tell.
+size_t current_rss()
+{
+#ifdef HAVE_SYSCONF
+    ifstream statm("/proc/self/statm");
+    size_t total_pages, resident_pages;
+    if (statm >> total_pages >> resident_pages)
+        return resident_pages * size_t(sysconf(_SC_PAGESIZE));
+#endif
+    return 0;
+}
+
+template <class Table>
+void run_shrink_test()
+{
+    const size_t n = 1 << 23;
+
+    size_t before = current_rss();
+    Table *table = new Table;
+    for (size_t i = 1; i <= n; i++)
+        table->set(i, i);
+    size_t full = current_rss();
+    for (size_t i = 1; i <= n; i++) {
+        if (i % 1000 != 0)
+            table->remove(i);
+    }
+    size_t after = current_rss();
+
+    cout << "[" << before << ", " << full << ", " << after << ", "
+         << table->byte_size(BytesAllocated) << "]";
+    delete table;
+}
+
+void run_shrink_tests()
+{
+    cout << "{" << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_shrink_test<OpenTable>();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_shrink_test<CloseTable>();
+    cout << endl;
+
+    cout << "}" << endl;
+}
+
+
+#ifdef HAVE_PTHREADS
+// === Snapshot test
+//
+// The owner thread runs a worklist (as in WorklistTest) on a
+// VersionedCloseTable for a while, with 0, 1, 2... reader threads taking
+// Snapshots and iterating over them as fast as they can. For each number of
+// readers, print [readers, owner operations/second, entries/second read by
+// all readers together, snapshots/second].
+//
+// The worklist adds a key and then removes one, so every Snapshot must see
+// either Size or Size + 1 entries; the readers check that.
+
+struct SnapshotReader {
+    VersionedCloseTable *table;
+    bool *stop;
+    size_t entries;
+    size_t snapshots;
+    pthread_t thread;
+};
+
+void *snapshot_reader_main(void *arg)
+{
+    SnapshotReader *r = (SnapshotReader *) arg;
+    while (!__atomic_load_n(r->stop, __ATOMIC_RELAXED)) {
+        size_t n = 0;
+        for (VersionedCloseTable::Snapshot s(*r->table); !s.empty(); s.popFront())
+            n++;
+        if (n != 10000 && n != 10001) {
+            cerr << "snapshot saw " << n << " entries" << endl;
+            abort();
+        }
+        r->entries += n;
+        r->snapshots++;
+    }
+    return NULL;
+}
+
+void run_snapshot_test(int max_readers)
+{
+    const size_t Size = 10000;
+    const double seconds = 1.0;
+
+    cout << "[\n";
+    for (int readers = 0; readers <= max_readers; readers++) {
+        VersionedCloseTable table;
+        Key r = 1, w = 1;
+        for (size_t i = 0; i < Size; i++) {
+            table.set(w, w);
+            w = w * 1103515245 + 12345;
+        }
+
+        bool stop = false;
+        std::vector<SnapshotReader> threads(readers);
+        for (int i = 0; i < readers; i++) {
+            threads[i].table = &table;
+            threads[i].stop = &stop;
+            threads[i].entries = 0;
+            threads[i].snapshots = 0;
+            if (pthread_create(&threads[i].thread, NULL, snapshot_reader_main, &threads[i]) != 0)
+                abort();
+        }
+
+        size_t ops = 0;
+        double t0 = now_seconds(), dt;
+        do {
+            for (int i = 0; i < 1000; i++) {
+                table.set(w, w);
+                w = w * 1103515245 + 12345;
+                if (!table.remove(r))
+                    abort();
+                r = r * 1103515245 + 12345;
+            }
+            ops += 2000;
+            dt = now_seconds() - t0;
+        } while (dt < seconds);
+
+        __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+        size_t entries = 0, snapshots = 0;
+        for (int i = 0; i < readers; i++) {
+            pthread_join(threads[i].thread, NULL);
+            entries += threads[i].entries;
+            snapshots += threads[i].snapshots;
+        }
+        dt = now_seconds() - t0;
+
+        cout << "\t[" << readers << ", " << ops / dt << ", " << entries / dt << ", "
+             << snapshots / dt << (readers < max_readers ? "]," : "]") << endl;
+    }
+    cout << "]" << endl;
+}
+
+
+// === Atom test
+//
+// Threads atomize a stream of identifiers drawn from a made-up corpus, the
+// way a JavaScript engine atomizes property names as it parses and runs code.
+// For 1, 2, 3... threads, on a fresh AtomTable each time, print [threads,
+// atomizations/second, atoms]. Then mark the atoms for the more common half
+// of the corpus, sweep the rest, and print [atoms before, atoms after,
+// seconds to sweep].
+//
+// The corpus starts with names real code uses all the time, followed by
+// camelCase names made of common words. Names are drawn with a Zipf
+// distribution, so a few are very common and most are rare, and nearly every
+// atomization finds an existing atom.
+
+static const char *const common_names[] = {
+    "length", "prototype", "constructor", "toString", "valueOf", "push",
+    "pop", "call", "apply", "bind", "get", "set", "has", "map", "forEach",
+    "filter", "reduce", "indexOf", "slice", "splice", "concat", "join",
+    "keys", "values", "then", "catch", "name", "value", "type", "id", "data",
+    "children", "parentNode", "style", "className", "addEventListener",
+    "getElementById", "querySelector", "innerHTML", "textContent", "x", "y",
+    "width", "height", "left", "top", "next", "done", "message", "stack",
+    "index", "key", "default", "exports", "module", "require", "__proto__",
+    "hasOwnProperty", "size", "add", "delete", "clear", "log", "error", "now",
+    "random", "floor", "max", "min", "parse", "stringify", "assign", "create",
+    "defineProperty", "iterator", "resolve", "reject", "options", "config",
+    "state", "props", "render", "result", "callback", "target", "event",
+    "handler", "count", "items", "list"
+};
+
+static const char *const name_parts[] = {
+    "get", "set", "is", "has", "on", "handle", "update", "create", "make",
+    "load", "save", "parse", "render", "init", "compute", "to", "from", "item",
+    "value", "node", "list", "map", "key", "name", "type", "event", "click",
+    "state", "data", "config", "option", "result", "error", "child", "parent",
+    "element", "style", "width", "height", "text", "user", "request",
+    "response", "buffer", "index", "count", "size", "cache", "layout",
+    "frame", "module", "scope", "token", "source", "target", "range", "point",
+    "color"
+};
+
+// Return n distinct identifiers, most common first.
+vector<string> make_identifier_corpus(size_t n)
+{
+    vector<string> corpus;
+    set<string> seen;
+    const size_t ncommon = sizeof(common_names) / sizeof(common_names[0]);
+    const size_t nparts = sizeof(name_parts) / sizeof(name_parts[0]);
+    for (size_t i = 0; i < ncommon && corpus.size() < n; i++) {
+        corpus.push_back(common_names[i]);
+        seen.insert(common_names[i]);
+    }
+    uint64_t r = 88172645463325252ull;
+    while (corpus.size() < n) {
+        string name = name_parts[xorshift(r) % nparts];
+        int words = 1 + xorshift(r) % 3;
+        for (int w = 1; w < words; w++) {
+            string part = name_parts[xorshift(r) % nparts];
+            part[0] = char(toupper(part[0]));
+            name += part;
+        }
+        if (xorshift(r) % 8 == 0)
+            name += char('0' + xorshift(r) % 10);
+        if (seen.insert(name).second)
+            corpus.push_back(name);
+    }
+    return corpus;
+}
+
+// Return a stream of n indexes into a corpus of the given size, drawn with a
+// Zipf distribution: index i is drawn with probability proportional to
+// 1 / (i + 1).
+vector<uint32_t> make_zipf_stream(size_t corpus_size, size_t n, uint64_t seed)
+{
+    vector<double> cumulative(corpus_size);
+    double total = 0;
+    for (size_t i = 0; i < corpus_size; i++) {
+        total += 1.0 / double(i + 1);
+        cumulative[i] = total;
+    }
+    vector<uint32_t> stream(n);
+    uint64_t r = seed;
+    for (size_t i = 0; i < n; i++) {
+        double u = double(xorshift(r) >> 11) / double(uint64_t(1) << 53) * total;
+        size_t k = lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin();
+        stream[i] = uint32_t(k < corpus_size ? k : corpus_size - 1);
+    }
+    return stream;
+}
+
+struct AtomWorker {
+    AtomTable *table;
+    const vector<string> *corpus;
+    vector<uint32_t> stream;
+    bool *go;
+    pthread_t thread;
+};
+
+void *atom_worker_main(void *arg)
+{
+    AtomWorker *w = (AtomWorker *) arg;
+    while (!__atomic_load_n(w->go, __ATOMIC_ACQUIRE))
+        ;
+    const vector<string> &corpus = *w->corpus;
+    for (size_t i = 0; i < w->stream.size(); i++) {
+        const string &name = corpus[w->stream[i]];
+        if (w->table->atomize(name.data(), name.size())->length() != name.size())
+            abort();
+    }
+    return NULL;
+}
+
+// Check that every name in the stream has exactly one atom, with the right
+// characters.
+void check_atoms(AtomTable &table, const vector<string> &corpus)
+{
+    for (size_t i = 0; i < corpus.size(); i++) {
+        const AtomTable::Atom *atom = table.lookup(corpus[i].data(), corpus[i].size());
+        if (atom && (atom->length() != corpus[i].size()
+                     || memcmp(atom->chars(), corpus[i].data(), corpus[i].size()) != 0
+                     || table.atomize(corpus[i].data(), corpus[i].size()) != atom))
+            abort();
+    }
+}
+
+void run_atom_test(int max_threads)
+{
+    const size_t CorpusSize = 50000;
+    const size_t OpsPerThread = 1 << 20;
+
+    vector<string> corpus = make_identifier_corpus(CorpusSize);
+    std::vector<AtomWorker> workers(max_threads);
+    for (int i = 0; i < max_threads; i++)
+        workers[i].stream = make_zipf_stream(corpus.size(), OpsPerThread, 12345 + i);
+
+    cout << "{\n\"atomize\": [\n";
+    AtomTable *table = NULL;
+    for (int threads = 1; threads <= max_threads; threads++) {
+        delete table;
+        table = new AtomTable;
+        bool go = false;
+        for (int i = 0; i < threads; i++) {
+            workers[i].table = table;
+            workers[i].corpus = &corpus;
+            workers[i].go = &go;
+            if (pthread_create(&workers[i].thread, NULL, atom_worker_main, &workers[i]) != 0)
+                abort();
+        }
+        double t0 = now_seconds();
+        __atomic_store_n(&go, true, __ATOMIC_RELEASE);
+        for (int i = 0; i < threads; i++)
+            pthread_join(workers[i].thread, NULL);
+        double dt = now_seconds() - t0;
+        check_atoms(*table, corpus);
+
+        cout << "\t[" << threads << ", " << threads * OpsPerThread / dt << ", " << table->size()
+             << (threads < max_threads ? "]," : "]") << endl;
+    }
+
+    // Keep the atoms for the first half of the corpus.
+    size_t before = table->size();
+    for (size_t i = 0; i < corpus.size() / 2; i++) {
+        if (const AtomTable::Atom *atom = table->lookup(corpus[i].data(), corpus[i].size()))
+            table->mark(atom);
+    }
+    double t0 = now_seconds();
+    table->sweep();
+    double dt = now_seconds() - t0;
+    for (size_t i = corpus.size() / 2; i < corpus.size(); i++) {
+        if (table->lookup(corpus[i].data(), corpus[i].size()))
+            abort();
+    }
+    check_atoms(*table, corpus);
+    cout << "],\n\"sweep\": [" << before << ", " << table->size() << ", " << dt << "]\n}" << endl;
+    delete table;
+}
+
+
+// === Parallel scan test
+//
+// Fill a table with n entries, remove a quarter of them, and reduce it with
+// parallel_reduce on 1, 2, 3... threads: once summing the values, which
+// doesn't care about order, and once folding the keys into a polynomial hash
+// in slot order, which does. Check both against a one-thread scan and print
+// [threads, entries/second summing, entries/second folding in order].
+
+struct SumValues {
+    typedef uint64_t Result;
+    Result identity() const { return 0; }
+    void add(Result &acc, KeyArg, ValueArg value) const { acc += value; }
+    void merge(Result &acc, const Result &later) const { acc += later; }
+};
+
+// h = h * Base + key for each key in turn, mod 2^64. The result for a run of
+// keys is (h, Base^count), so two runs merge as (h1 * pow2 + h2, pow1 * pow2).
+struct FoldKeys {
+    static const uint64_t Base = 0x100000001b3ull;
+
+    struct Result {
+        uint64_t hash;
+        uint64_t pow;
+    };
+
+    Result identity() const {
+        Result r = { 0, 1 };
+        return r;
+    }
+    void add(Result &acc, KeyArg key, ValueArg) const {
+        acc.hash = acc.hash * Base + key;
+        acc.pow *= Base;
+    }
+    void merge(Result &acc, const Result &later) const {
+        acc.hash = acc.hash * later.pow + later.hash;
+        acc.pow *= later.pow;
+    }
+};
+
+template <class Reducer>
+struct SequentialReduce {
+    const Reducer &reducer;
+    typename Reducer::Result acc;
+
+    explicit SequentialReduce(const Reducer &reducer) : reducer(reducer), acc(reducer.identity()) {}
+    void operator()(KeyArg key, ValueArg value) { reducer.add(acc, key, value); }
+};
+
+template <class Table>
+void run_parallel_scan_test(size_t n, int max_threads)
+{
+    Table table;
+    fill_and_thin(table, n, 25);
+
+    SumValues sum;
+    FoldKeys fold;
+    SequentialReduce<SumValues> expected_sum(sum);
+    table.scan_slots(0, table.slot_count(), expected_sum);
+    SequentialReduce<FoldKeys> expected_fold(fold);
+    table.scan_slots(0, table.slot_count(), expected_fold);
+
+    cout << "[\n";
+    for (int threads = 1; threads <= max_threads; threads++) {
+        double best_sum = 0, best_fold = 0;
+        for (int trial = 0; trial < 3; trial++) {
+            double t0 = now_seconds();
+            if (parallel_reduce(table, sum, threads, false) != expected_sum.acc)
+                abort();
+            double t1 = now_seconds();
+            FoldKeys::Result r = parallel_reduce(table, fold, threads, true);
+            double t2 = now_seconds();
+            if (r.hash != expected_fold.acc.hash || r.pow != expected_fold.acc.pow)
+                abort();
+            if (best_sum == 0 || t1 - t0 < best_sum)
+                best_sum = t1 - t0;
+            if (best_fold == 0 || t2 - t1 < best_fold)
+                best_fold = t2 - t1;
+        }
+        cout << (threads == 1 ? "\t\t[" : ",\n\t\t[") << threads << ", "
+             << table.size() / best_sum << ", " << table.size() / best_fold << "]";
+        cout.flush();
+    }
+    cout << "\n\t]";
+}
+
+void run_parallel_scan_tests(int max_threads)
+{
+    const size_t n = size_t(1) << 23;
+    cout << "{\n\t\"OpenTable\": ";
+    run_parallel_scan_test<OpenTable>(n, max_threads);
+    cout << ",\n\t\"CloseTable\": ";
+    run_parallel_scan_test<CloseTable>(n, max_threads);
+    cout << "\n}" << endl;
+}
+#endif  // HAVE_PTHREADS
+
+int main(int argc, const char **argv) {
+    if (argc == 2 && (strcmp(argv[1], "-m") == 0 || strcmp(argv[1], "-w") == 0)) {
+        measure_space(argv[1][1] == 'm' ? BytesAllocated : BytesWritten);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-s") == 0) {
+        run_scale_tests(argc == 3 ? size_t(atof(argv[2]) * 1024 * 1024) : default_scale_budget());
+#ifdef HAVE_MMAP
+    } else if (argc >= 2 && argc <= 4 && strcmp(argv[1], "-o") == 0) {
+        run_out_of_core_test(size_t((argc >= 3 ? atof(argv[2]) : 64) * 1024 * 1024),
+                             size_t((argc >= 4 ? atof(argv[3]) : 1024) * 1024 * 1024));
+#endif
+#ifdef HAVE_FORK
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-j") == 0) {
+        run_farm(argc == 3 ? size_t(atoi(argv[2])) : 0);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-f") == 0) {
+        run_isolated_trials(argc == 3 ? argv[2] : NULL);
+#endif
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-i") == 0) {
+        run_inlined_speed_tests(argc == 3 ? argv[2] : NULL);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-g") == 0) {
+        run_packed_speed_tests(argc == 3 ? argv[2] : NULL);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-p") == 0) {
+        run_prefetch_tests(argc == 3 ? size_t(atof(argv[2])) : size_t(1) << 22);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-x") == 0) {
+        run_export_tests(argc == 3 ? size_t(atof(argv[2])) : size_t(1) << 20);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-y") == 0) {
+        run_card_tests(argc == 3 ? size_t(atof(argv[2])) : size_t(1) << 22);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-z") == 0) {
+        run_serialize_tests(argc == 3 ? size_t(atof(argv[2])) : size_t(1) << 22);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-q") == 0) {
+        run_quotient_tests(argc == 3 ? size_t(atof(argv[2])) : size_t(1) << 23);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-d") == 0) {
+        run_direct_tests(argc == 3 ? size_t(atof(argv[2])) : size_t(1) << 23);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-e") == 0) {
+        run_frozen_tests(argc == 3 ? size_t(atof(argv[2])) : size_t(1) << 23);
+    } else if (argc == 2 && strcmp(argv[1], "-h") == 0) {
+        run_hashed_key_tests();
+    } else if (argc == 2 && strcmp(argv[1], "-n") == 0) {
+        run_handle_tests();
+    } else if (argc == 2 && strcmp(argv[1], "-u") == 0) {
+        return run_probe_overhead_check() ? 0 : 1;
+    } else if (argc == 2 && strcmp(argv[1], "-t") == 0) {
+        run_small_tables_tests();
+    } else if (argc == 2 && strcmp(argv[1], "-b") == 0) {
+        run_budget_tests();
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-c") == 0) {
+        run_cold_tables_test(argc == 3 ? size_t(atof(argv[2])) : 10000);
+    } else if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+        run_shrink_tests();
+#ifdef HAVE_PHASE_TIMING
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-k") == 0) {
+        run_phase_tests(argc == 3 ? argv[2] : NULL);
+#endif
+#ifdef HAVE_PTHREADS
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-a") == 0) {
+        run_atom_test(argc == 3 ? atoi(argv[2]) : 4);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-v") == 0) {
+        run_snapshot_test(argc == 3 ? atoi(argv[2]) : 4);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-l") == 0) {
+        run_parallel_scan_tests(argc == 3 ? atoi(argv[2]) : 4);
+#endif
+    } else if (argc == 1) {
+        //cout << measure_single_run<LookupHitTest<OpenTable> >(1000000) << endl;
+        run_all_speed_tests();
+    } else if (argc == 2) {
+        run_one_speed_test(argv[1]);
+    } else {
+        cerr << "usage:\n  " << argv[0] << "\n  " << argv[0] << " -m\n  " << argv[0] << " -w\n"
+             << "  " << argv[0] << " -b\n"
+             << "  " << argv[0] << " -c [tables]\n"
+             << "  " << argv[0] << " -d [max-entries]\n"
+             << "  " << argv[0] << " -e [max-entries]\n"
+             << "  " << argv[0] << " -g [test-name]\n"
+             << "  " << argv[0] << " -h\n"
+             << "  " << argv[0] << " -i [test-name]\n"
+             << "  " << argv[0] << " -n\n"
+             << "  " << argv[0] << " -p [entries]\n"
+             << "  " << argv[0] << " -q [max-entries]\n"
+             << "  " << argv[0] << " -r\n"
+             << "  " << argv[0] << " -s [budget-in-megabytes]\n"
+             << "  " << argv[0] << " -t\n"
+             << "  " << argv[0] << " -u\n"
+             << "  " << argv[0] << " -x [entries]\n"
+             << "  " << argv[0] << " -y [max-entries]\n"
+             << "  " << argv[0] << " -z [max-entries]\n"
+#ifdef HAVE_PHASE_TIMING
+             << "  " << argv[0] << " -k [test-name]\n"
+#endif
+#ifdef HAVE_FORK
+             << "  " << argv[0] << " -j [max-workers]\n"
+             << "  " << argv[0] << " -f [test-name]\n"
+#endif
+#ifdef HAVE_PTHREADS
+             << "  " << argv[0] << " -a [max-threads]\n"
+             << "  " << argv[0] << " -v [max-readers]\n"
+             << "  " << argv[0] << " -l [max-threads]\n"
+#endif
+#ifdef HAVE_MMAP
+             << "  " << argv[0] << " -o [resident-megabytes [max-table-megabytes]]\n"
+#endif
+             ;
         return 1;
     }
 
@@ -22,13 +22,21 @@ def main(filename, outfilename):
     loglog(index, series1, '-', color='#cccccc', label='dense_hash_map (open addressing)')
     loglog(index, series2, 'b-', label='open addressing')
     loglog(index, series3, 'r-', label='Close table')
+    if data.shape[1] > 4:
+        # What each table would take frozen, as a FrozenTable.
+        loglog(index, data[:,4], 'g-', label='frozen (Elias-Fano)')
+    if data.shape[1] > 5:
+        loglog(index, data[:,5], 'm-', label='quotiented open addressing')
+    if data.shape[1] > 6:
+        loglog(index, data[:,6], 'c-', label='direct-indexed (dense keys)')
     legend(loc='upper left')
     savefig(outfilename, format='png')
 
     # compute and print summary information about which is bigger
     r1 = []
     r2 = []
-    for i, _, s1, s2 in data:
+    for row in data:
+        s1, s2 = row[2], row[3]
         if s1 > s2:
             r1.append(s1/s2)
         else:
@@ -10,23 +10,36 @@ def main(filename):
 
     # plot the graph and save it
     for testname, results in data.items():
+        # hashbench -j adds calibration results, and hashbench -f a baseline
+        # RSS; they aren't tests.
+        if testname in ('Interference', 'IsolationBaseline'):
+            continue
         fig = plt.figure()
         fig.suptitle(testname)
         axes = fig.gca()
         axes.set_ylabel('speed (operations/second)')
-        hi = max(max(x/y for x, y in series) for series in results.values())
+        # Points are [n, seconds], or [n, seconds, peak RSS] from hashbench -f.
+        hi = max(max(p[0]/p[1] for p in series) for series in results.values())
         axes.set_ylim(bottom=0, top=hi * 1.2)
         axes.set_xlabel('number of operations')
 
         def show(data, *args, **kwargs):
-            xs = [x for x, y in data]
-            ys = [x/y for x, y in data]
+            xs = [p[0] for p in data]
+            ys = [p[0]/p[1] for p in data]
             axes.plot(xs, ys, *args, **kwargs)
 
         if 'DenseTable' in results:
             show(results['DenseTable'], '-o', color='#cccccc', label='dense_hash_map (open addressing)')
-        show(results['OpenTable'], 'b-o', label='open addressing')
-        show(results['CloseTable'], 'r-o', label='Close table')
+        if 'OpenTable' in results:
+            show(results['OpenTable'], 'b-o', label='open addressing')
+        if 'CloseTable' in results:
+            show(results['CloseTable'], 'r-o', label='Close table')
+        # hashbench -i adds inlined builds of the same tables, and other modes
+        # may add other tables; plot anything else with default colors.
+        known = ('DenseTable', 'OpenTable', 'CloseTable')
+        for name in sorted(results):
+            if name not in known:
+                show(results[name], '--o', label=name)
         axes.legend(loc='best')
         fig.savefig(testname + "-speed.png", format='png')
 
@@ -0,0 +1,1157 @@
+// tables-core-inl.h - definitions of the in-memory hash tables declared in
+// tables-core.h.
+//
+// Like tables-core.h, this has no include guard and is included more than
+// once: by tables.cpp, by tables-inline.h inside namespace inlined, and by
+// hashbench.cpp inside namespace slowhash.
+// The includer defines two macros first:
+//     TABLES_INLINE - put in front of the table methods that benchmarks call
+//                     in their inner loops
+//     TABLES_COLD - put in front of rehash, which is too big to be worth
+//                   inlining everywhere
+// and includes <cstring> and, if HAVE_MMAP, <sys/mman.h> and <unistd.h>.
+
+// Return 2 * n, first checking that an array of that many elements of the
+// given size would still fit in the address space.
+static size_t
+double_capacity(size_t n, size_t elem_size)
+{
+    if (n > SIZE_MAX / 2 / elem_size)
+        abort();
+    return n * 2;
+}
+
+
+// === Array storage
+//
+// Tables allocate their arrays with new_array and free them with
+// delete_array. Small arrays come from new[]. Arrays of large_array_bytes or
+// more are mapped straight from the kernel, so that when a big table shrinks
+// the memory really goes back to the system: malloc tends to keep big freed
+// blocks around, or to carve the smaller replacement array out of them, and
+// then the process's RSS stays at its peak forever.
+//
+// A large array can also give back the pages past a given point while
+// staying mapped (release_array_tail), which lets CloseTable compact and
+// shrink large arrays in place. A large array's mapping starts with a header
+// recording its length, since that can be more than the table thinks the
+// array's size is.
+
+#ifdef HAVE_MMAP
+
+static const size_t large_array_bytes = 256 * 1024;
+
+struct LargeArrayHeader {
+    size_t mapped_bytes;
+    char padding[64 - sizeof(size_t)];   // keep the array cache-line aligned
+};
+
+static size_t
+page_size()
+{
+    static size_t size = size_t(sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+static bool
+is_large_array(size_t bytes)
+{
+    return bytes >= large_array_bytes;
+}
+
+// Return a zero-filled array of the given size.
+static void *
+map_large_array(size_t bytes)
+{
+    size_t mapped = (bytes + sizeof(LargeArrayHeader) + page_size() - 1) & ~(page_size() - 1);
+    void *p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        abort();
+    LargeArrayHeader *header = (LargeArrayHeader *) p;
+    header->mapped_bytes = mapped;
+    return header + 1;
+}
+
+static void
+unmap_large_array(void *array)
+{
+    LargeArrayHeader *header = (LargeArrayHeader *) array - 1;
+    munmap(header, header->mapped_bytes);
+}
+
+#endif  // HAVE_MMAP
+
+// Allocate an array of n elements. Elements of a small array are
+// default-initialized; elements of a large one are zero.
+template <class T>
+static T *
+new_array(size_t n)
+{
+#ifdef HAVE_MMAP
+    if (is_large_array(n * sizeof(T)))
+        return (T *) map_large_array(n * sizeof(T));
+#endif
+    return new T[n];
+}
+
+// Allocate an array of n elements, all zero.
+template <class T>
+static T *
+new_zeroed_array(size_t n)
+{
+#ifdef HAVE_MMAP
+    if (is_large_array(n * sizeof(T)))
+        return (T *) map_large_array(n * sizeof(T));
+#endif
+    T *p = new T[n];
+    memset(p, 0, n * sizeof(T));
+    return p;
+}
+
+// Free an array allocated by new_array or new_zeroed_array. n must be the
+// number of elements it was allocated with, or, if it has been shrunk in
+// place, the number it was shrunk to.
+template <class T>
+static void
+delete_array(T *p, size_t n)
+{
+#ifdef HAVE_MMAP
+    if (is_large_array(n * sizeof(T))) {
+        unmap_large_array(p);
+        return;
+    }
+#else
+    (void) n;
+#endif
+    delete[] p;
+}
+
+// Give back to the system the pages of an array that lie entirely beyond its
+// first keep_bytes. They read as zeroes if touched again. This is only for
+// arrays that can_shrink_in_place; for anything else it does nothing.
+//
+// MADV_FREE would be cheaper, but the kernel only takes the pages when it
+// is short of memory, so RSS doesn't go down, and that's what we're after.
+static void
+release_array_tail(void *array, size_t keep_bytes)
+{
+#ifdef HAVE_MMAP
+    LargeArrayHeader *header = (LargeArrayHeader *) array - 1;
+    char *start = (char *) array + keep_bytes;
+    char *end = (char *) header + header->mapped_bytes;
+    start = (char *) ((uintptr_t(start) + page_size() - 1) & ~uintptr_t(page_size() - 1));
+    if (start < end)
+        madvise(start, end - start, MADV_DONTNEED);
+#else
+    (void) array;
+    (void) keep_bytes;
+#endif
+}
+
+// Return true if an array of old_n elements can be shrunk in place to new_n
+// elements. Only large arrays that stay large can.
+template <class T>
+static bool
+can_shrink_in_place(size_t old_n, size_t new_n)
+{
+#ifdef HAVE_MMAP
+    return new_n <= old_n && is_large_array(new_n * sizeof(T));
+#else
+    (void) old_n;
+    (void) new_n;
+    return false;
+#endif
+}
+
+// Bulk export. keys(), values() and entries() copy one field, or both, of
+// each live entry in an array of entries. The policies below say which.
+struct ExportKeys {
+    typedef Key Out;
+    template <class Entry> static Out get(const Entry &e) { return e.key; }
+};
+
+struct ExportValues {
+    typedef Value Out;
+    template <class Entry> static Out get(const Entry &e) { return e.value; }
+};
+
+struct ExportEntries {
+    typedef KeyValue Out;
+    template <class Entry> static Out get(const Entry &e) {
+        KeyValue kv = { e.key, e.value };
+        return kv;
+    }
+};
+
+// Copy the live entries among the first length of entries to out, stopping
+// after count of them, and return how many were copied. The entries are
+// tested four at a time: a block with no holes is copied straight, a block
+// of holes is skipped, and a mixed block is compacted without branches,
+// writing every entry and advancing past only the live ones. That overwrites
+// up to three elements of out beyond the last live entry, so it is done only
+// while there is room for them.
+template <class Export, class Entry>
+static size_t
+export_live(const Entry *entries, size_t length, typename Export::Out *out, size_t count)
+{
+    size_t i = 0, j = 0;
+    for (; i + 4 <= length && j < count; i += 4) {
+        const Entry *e = entries + i;
+        unsigned live = live_mask4(e[0].key, e[1].key, e[2].key, e[3].key);
+        if (live == 0xf) {
+            out[j] = Export::get(e[0]);
+            out[j + 1] = Export::get(e[1]);
+            out[j + 2] = Export::get(e[2]);
+            out[j + 3] = Export::get(e[3]);
+            j += 4;
+        } else if (live == 0) {
+            continue;
+        } else if (j + 4 <= count) {
+            out[j] = Export::get(e[0]);
+            j += live & 1;
+            out[j] = Export::get(e[1]);
+            j += (live >> 1) & 1;
+            out[j] = Export::get(e[2]);
+            j += (live >> 2) & 1;
+            out[j] = Export::get(e[3]);
+            j += live >> 3;
+        } else {
+            for (unsigned b = 0; b < 4; b++) {
+                if (live & (1u << b))
+                    out[j++] = Export::get(e[b]);
+            }
+        }
+    }
+    for (; i < length && j < count; i++) {
+        if (isLive(entries[i].key))
+            out[j++] = Export::get(entries[i]);
+    }
+    return j;
+}
+
+
+// === OpenTable
+
+TABLES_INLINE
+OpenTable::OpenTable() {
+    table = new_array<Entry>(8);
+    mask = 7;
+    live_count = 0;
+    nonempty_count = 0;
+    cards = NULL;
+}
+
+TABLES_INLINE
+OpenTable::~OpenTable() {
+    delete_array(table, mask + 1);
+    if (cards)
+        delete_array(cards, card_words(mask + 1));
+}
+
+TABLES_INLINE OpenTable::Entry *
+OpenTable::lookup(HashedKey key)
+{
+    TABLES_PHASE_START(t);
+    hashcode_t h = key.hash;
+    size_t home = h & mask, i = home;
+    h >>= 3;
+    Entry *found = NULL;
+    for (;;) {
+        Key k = table[i].key;
+        TABLES_PHASE(t, PhaseProbe);
+        if (isEmpty(k))
+            break;
+        if (k == key.key) {
+            found = &table[i];
+            break;
+        }
+        i = (i + (h | 1)) & mask;
+        TABLES_PHASE(t, PhaseCompare);
+    }
+    TABLES_PHASE(t, PhaseCompare);
+
+    // The probe loop is tight enough that counting in it would show, so
+    // lookups that go past their home slot check the semaphore and count
+    // afterwards. Most lookups end in their home slot and skip even that.
+    if (i != home && TABLES_PROBE_ENABLED(open_long_probe))
+        trace_probe_length(key);
+    return found;
+}
+
+TABLES_INLINE const OpenTable::Entry *
+OpenTable::lookup(HashedKey key) const
+{
+    return const_cast<OpenTable *>(this)->lookup(key);
+}
+
+TABLES_COLD void
+OpenTable::rehash(size_t new_capacity)
+{
+    TABLES_PHASE_START(phase_start);
+    TABLES_PHASE_PAUSE();
+    uint64_t start = TABLES_PROBE_ENABLED(open_rehash) || TABLES_PROBE_ENABLED(open_shrink)
+                     ? trace_clock_ns() : 0;
+    Entry *old_table = table;
+    size_t old_capacity = mask + 1;
+    Entry *old_table_end = table + old_capacity;
+    uint64_t *old_cards = cards;
+    cards = NULL;               // so that set() doesn't mark every entry
+    table = new_array<Entry>(new_capacity);
+    mask = new_capacity - 1;
+    live_count = 0;
+    nonempty_count = 0;
+    for (Entry *p = old_table; p != old_table_end; ++p) {
+        if (isLive(p->key))
+            set(p->key, p->value);
+    }
+    if (old_cards) {
+        // Find the entries that were on dirty cards again, and mark their
+        // new cards.
+        cards = new_zeroed_array<uint64_t>(card_words(new_capacity));
+        for (Entry *p = old_table; p != old_table_end; ++p) {
+            if (isLive(p->key) && card_is_dirty(old_cards, p - old_table))
+                mark_card(cards, lookup(hashed(p->key)) - table);
+        }
+        delete_array(old_cards, card_words(old_capacity));
+    }
+    delete_array(old_table, old_capacity);
+
+    if (start != 0) {
+        uint64_t ns = trace_clock_ns() - start;
+        if (new_capacity < old_capacity)
+            TABLES_PROBE4(open_shrink, old_capacity, new_capacity, live_count, ns);
+        else
+            TABLES_PROBE4(open_rehash, old_capacity, new_capacity, live_count, ns);
+    }
+    TABLES_PHASE_RESUME();
+    TABLES_PHASE(phase_start, PhaseRehash);
+}
+
+// Walk key's probe sequence again, counting slots, for the open_long_probe
+// probe. Only called while a tracer is attached to it.
+TABLES_COLD void
+OpenTable::trace_probe_length(HashedKey key) const
+{
+    hashcode_t h = key.hash;
+    size_t i = h & mask;
+    h >>= 3;
+    size_t length = 1;
+    while (!isEmpty(table[i].key) && table[i].key != key.key) {
+        i = (i + (h | 1)) & mask;
+        length++;
+    }
+    if (length > long_probe_length)
+        TABLES_PROBE2(open_long_probe, length, mask + 1);
+}
+
+TABLES_INLINE size_t
+OpenTable::byte_size(ByteSizeOption) const
+{
+    return sizeof(*this) + (mask + 1) * sizeof(Entry)
+        + (cards ? card_words(mask + 1) * sizeof(uint64_t) : 0);
+}
+
+TABLES_INLINE size_t
+OpenTable::size() const
+{
+    return live_count;
+}
+
+TABLES_INLINE size_t
+OpenTable::slack_bytes() const
+{
+    return (mask + 1 - compact_capacity(live_count)) * sizeof(Entry);
+}
+
+TABLES_COLD void
+OpenTable::compact()
+{
+    size_t capacity = compact_capacity(live_count);
+    if (capacity < mask + 1)
+        rehash(capacity);
+}
+
+TABLES_COLD void
+OpenTable::enable_cards()
+{
+    if (!cards)
+        cards = new_zeroed_array<uint64_t>(card_words(mask + 1));
+}
+
+TABLES_INLINE HashedKey
+OpenTable::hashed(KeyArg key) const
+{
+    TABLES_PHASE_START(t);
+    HashedKey hk = { key, hash(key) };
+    TABLES_PHASE(t, PhaseHash);
+    return hk;
+}
+
+TABLES_INLINE bool
+OpenTable::has(KeyArg key) const
+{
+    return has(hashed(key));
+}
+
+TABLES_INLINE bool
+OpenTable::has(HashedKey key) const
+{
+    return lookup(key) != NULL;
+}
+
+TABLES_INLINE Value
+OpenTable::get(KeyArg key) const
+{
+    return get(hashed(key));
+}
+
+TABLES_INLINE Value
+OpenTable::get(HashedKey key) const
+{
+    const Entry *e = lookup(key);
+    TABLES_PHASE_START(t);
+    Value v = e ? e->value : Value();
+    TABLES_PHASE(t, PhaseValue);
+    return v;
+}
+
+TABLES_INLINE void
+OpenTable::set(KeyArg key, ValueArg value)
+{
+    set(hashed(key), value);
+}
+
+TABLES_INLINE void
+OpenTable::set(HashedKey key, ValueArg value)
+{
+    // Probe until we find the key or an empty slot. The key may lie beyond a
+    // tombstone, so we can't stop at the first one, but if the key is absent
+    // we reuse the first tombstone we passed.
+    hashcode_t h = key.hash;
+    size_t i = h & mask;
+    h >>= 3;
+    Entry *tomb = NULL;
+    TABLES_PHASE_START(t);
+    for (;;) {
+        Key k = table[i].key;
+        TABLES_PHASE(t, PhaseProbe);
+        if (isEmpty(k))
+            break;
+        if (k == key.key) {
+            TABLES_PHASE(t, PhaseCompare);
+            table[i].value = value;
+            mark_card(cards, i);
+            TABLES_PHASE(t, PhaseValue);
+            return;
+        }
+        if (!tomb && isTombstone(k))
+            tomb = &table[i];
+        i = (i + (h | 1)) & mask;
+        TABLES_PHASE(t, PhaseCompare);
+    }
+    TABLES_PHASE(t, PhaseCompare);
+
+    Entry *e = tomb ? tomb : &table[i];
+    e->key = key.key;
+    e->value = value;
+    mark_card(cards, e - table);
+    live_count++;
+    if (!tomb)
+        nonempty_count++;
+    TABLES_PHASE(t, PhaseValue);
+    if (nonempty_count > max_fill(mask + 1))
+        rehash(double_capacity(mask + 1, sizeof(Entry)));
+}
+
+TABLES_INLINE bool
+OpenTable::remove(KeyArg key)
+{
+    return remove(hashed(key));
+}
+
+TABLES_INLINE bool
+OpenTable::remove(HashedKey key)
+{
+    Entry *e = lookup(key);
+    if (!e)
+        return false;
+    TABLES_PHASE_START(t);
+    makeTombstone(e->key);
+    live_count--;
+    TABLES_PHASE(t, PhaseValue);
+    if (mask > 7 && live_count < min_fill(mask + 1))
+        rehash((mask + 1) >> 1);
+    return true;
+}
+
+TABLES_INLINE void
+OpenTable::prefetch(KeyArg key) const
+{
+    prefetch(hashed(key));
+}
+
+TABLES_INLINE void
+OpenTable::prefetch(HashedKey key) const
+{
+    prefetch_address(&table[key.hash & mask]);
+}
+
+TABLES_INLINE size_t
+OpenTable::keys(Key *out) const
+{
+    return export_live<ExportKeys>(table, mask + 1, out, live_count);
+}
+
+TABLES_INLINE size_t
+OpenTable::values(Value *out) const
+{
+    return export_live<ExportValues>(table, mask + 1, out, live_count);
+}
+
+TABLES_INLINE size_t
+OpenTable::entries(KeyValue *out) const
+{
+    return export_live<ExportEntries>(table, mask + 1, out, live_count);
+}
+
+
+// === DenseTable
+
+#ifdef HAVE_SPARSEHASH
+
+TABLES_INLINE
+DenseTable::DenseTable()
+{
+    Key k;
+    makeEmpty(k);
+    map.set_empty_key(k);
+    makeTombstone(k);
+    map.set_deleted_key(k);
+}
+
+TABLES_INLINE size_t
+DenseTable::byte_size(ByteSizeOption) const
+{
+    return sizeof(*this) + sizeof(std::pair<const Key, Value>) * map.bucket_count();
+}
+
+TABLES_INLINE size_t
+DenseTable::size() const
+{
+    return map.size();
+}
+
+TABLES_INLINE bool
+DenseTable::has(KeyArg key) const
+{
+    return map.find(key) != map.end();
+}
+
+TABLES_INLINE Value
+DenseTable::get(KeyArg key) const
+{
+    Map::const_iterator it = map.find(key);
+    return (it == map.end() ? Value() : it->second);
+}
+
+TABLES_INLINE void
+DenseTable::set(KeyArg key, ValueArg value)
+{
+    map[key] = value;
+}
+
+TABLES_INLINE bool
+DenseTable::remove(KeyArg key)
+{
+    Map::iterator it = map.find(key);
+    if (it == map.end())
+        return false;
+    map.erase(it);
+    size_t n = map.bucket_count();
+    if (n > 32 && map.size() <= n / 8)
+        map.resize(0);
+    return true;
+}
+
+TABLES_INLINE void
+DenseTable::prefetch(KeyArg) const
+{
+}
+
+TABLES_INLINE HashedKey
+DenseTable::hashed(KeyArg key) const
+{
+    TABLES_PHASE_START(t);
+    HashedKey hk = { key, hash(key) };
+    TABLES_PHASE(t, PhaseHash);
+    return hk;
+}
+
+TABLES_INLINE bool
+DenseTable::has(HashedKey key) const
+{
+    return has(key.key);
+}
+
+TABLES_INLINE Value
+DenseTable::get(HashedKey key) const
+{
+    return get(key.key);
+}
+
+TABLES_INLINE void
+DenseTable::set(HashedKey key, ValueArg value)
+{
+    set(key.key, value);
+}
+
+TABLES_INLINE bool
+DenseTable::remove(HashedKey key)
+{
+    return remove(key.key);
+}
+
+TABLES_INLINE void
+DenseTable::prefetch(HashedKey) const
+{
+}
+
+TABLES_INLINE size_t
+DenseTable::keys(Key *out) const
+{
+    size_t j = 0;
+    for (Map::const_iterator it = map.begin(); it != map.end(); ++it)
+        out[j++] = it->first;
+    return j;
+}
+
+TABLES_INLINE size_t
+DenseTable::values(Value *out) const
+{
+    size_t j = 0;
+    for (Map::const_iterator it = map.begin(); it != map.end(); ++it)
+        out[j++] = it->second;
+    return j;
+}
+
+TABLES_INLINE size_t
+DenseTable::entries(KeyValue *out) const
+{
+    size_t j = 0;
+    for (Map::const_iterator it = map.begin(); it != map.end(); ++it) {
+        KeyValue kv = { it->first, it->second };
+        out[j++] = kv;
+    }
+    return j;
+}
+
+#endif  // HAVE_SPARSEHASH
+
+
+// === CloseTable
+
+TABLES_INLINE
+CloseTable::CloseTable()
+{
+    size_t buckets = initial_buckets();
+    table = new_zeroed_array<EntryPtr>(buckets);
+    table_mask = buckets - 1;
+    entries_capacity = capacity_for(buckets);
+    data = new_array<Entry>(entries_capacity);
+    entries_length = 0;
+    live_count = 0;
+    ranges = NULL;
+    generation = 0;
+    cards = NULL;
+}
+
+TABLES_INLINE
+CloseTable::~CloseTable()
+{
+    delete_array(table, table_mask + 1);
+    delete_array(data, entries_capacity);
+    if (cards)
+        delete_array(cards, card_words(entries_capacity));
+}
+
+TABLES_INLINE CloseTable::Entry *
+CloseTable::lookup(KeyArg key, hashcode_t h)
+{
+    TABLES_PHASE_START(t);
+    Entry *e;
+    for (e = table[h & table_mask]; TABLES_PHASE(t, PhaseProbe), e; e = e->chain) {
+        if (e->key == key)
+            break;
+        TABLES_PHASE(t, PhaseCompare);
+    }
+    TABLES_PHASE(t, PhaseCompare);
+
+    // As in OpenTable::lookup, the chain is only counted while a tracer is
+    // attached to close_long_chain, by walking it again.
+    if (TABLES_PROBE_ENABLED(close_long_chain))
+        trace_chain_length(key, h);
+    return e;
+}
+
+TABLES_INLINE const CloseTable::Entry *
+CloseTable::lookup(HashedKey key) const {
+    return const_cast<CloseTable *>(this)->lookup(key.key, key.hash);
+}
+
+// Walk key's chain again, counting entries, for the close_long_chain probe.
+// Only called while a tracer is attached to it.
+TABLES_COLD void
+CloseTable::trace_chain_length(KeyArg key, hashcode_t h) const
+{
+    size_t length = 1;
+    for (const Entry *e = table[h & table_mask]; e && e->key != key; e = e->chain)
+        length++;
+    if (length > long_probe_length)
+        TABLES_PROBE2(close_long_chain, length, table_mask + 1);
+}
+
+TABLES_COLD void
+CloseTable::rehash(size_t new_table_mask)
+{
+    size_t new_capacity = capacity_for(new_table_mask + 1);
+    if (new_capacity > SIZE_MAX / sizeof(Entry))
+        abort();
+    TABLES_PHASE_START(phase_start);
+    uint64_t start = TABLES_PROBE_ENABLED(close_rehash) || TABLES_PROBE_ENABLED(close_shrink)
+                     || TABLES_PROBE_ENABLED(close_compact)
+                     ? trace_clock_ns() : 0;
+    size_t old_buckets = table_mask + 1;
+    size_t old_length = entries_length;
+
+    // Large arrays that aren't growing are reused. Compacting the entries in
+    // place is safe because q never passes p.
+    size_t new_buckets = new_table_mask + 1;
+    bool table_in_place = can_shrink_in_place<EntryPtr>(table_mask + 1, new_buckets);
+    bool entries_in_place = can_shrink_in_place<Entry>(entries_capacity, new_capacity);
+    EntryPtr *new_table;
+    if (table_in_place) {
+        new_table = table;
+        memset(new_table, 0, new_buckets * sizeof(EntryPtr));
+    } else {
+        new_table = new_zeroed_array<EntryPtr>(new_buckets);
+    }
+    Entry *new_entries = entries_in_place ? data : new_array<Entry>(new_capacity);
+    uint64_t *new_cards = cards ? new_zeroed_array<uint64_t>(card_words(new_capacity)) : NULL;
+
+    Entry *q = new_entries;
+    for (Entry *p = data, *end = data + entries_length; p != end; p++) {
+        if (!isEmpty(p->key)) {
+            hashcode_t h = hash(p->key) & new_table_mask;
+            q->key = p->key;
+            q->value = p->value;
+            q->chain = new_table[h];
+            new_table[h] = q;
+            if (new_cards && card_is_dirty(cards, p - data))
+                mark_card(new_cards, q - new_entries);
+            q++;
+        }
+    }
+
+    if (table_in_place)
+        release_array_tail(table, new_buckets * sizeof(EntryPtr));
+    else
+        delete_array(table, table_mask + 1);
+    if (entries_in_place)
+        release_array_tail(data, live_count * sizeof(Entry));
+    else
+        delete_array(data, entries_capacity);
+    if (cards)
+        delete_array(cards, card_words(entries_capacity));
+
+    table = new_table;
+    table_mask = new_table_mask;
+    data = new_entries;
+    entries_capacity = new_capacity;
+    entries_length = live_count;
+    cards = new_cards;
+    generation++;
+
+    for (Range *r = ranges; r; r = r->next)
+        r->onCompact();
+
+    if (start != 0) {
+        uint64_t ns = trace_clock_ns() - start;
+        if (new_buckets == old_buckets)
+            TABLES_PROBE4(close_compact, new_buckets, old_length, live_count, ns);
+        else if (new_buckets < old_buckets)
+            TABLES_PROBE4(close_shrink, old_buckets, new_buckets, live_count, ns);
+        else
+            TABLES_PROBE4(close_rehash, old_buckets, new_buckets, live_count, ns);
+    }
+    TABLES_PHASE(phase_start, PhaseRehash);
+}
+
+TABLES_INLINE size_t
+CloseTable::byte_size(ByteSizeOption option) const
+{
+    return sizeof(*this)
+        + (table_mask + 1) * sizeof(EntryPtr)
+        + (option == BytesAllocated ? entries_capacity : entries_length) * sizeof(Entry)
+        + (cards ? card_words(entries_capacity) * sizeof(uint64_t) : 0);
+}
+
+TABLES_INLINE size_t
+CloseTable::size() const
+{
+    return live_count;
+}
+
+TABLES_INLINE size_t
+CloseTable::slack_bytes() const
+{
+    size_t buckets = compact_buckets(live_count);
+    return (table_mask + 1 - buckets) * sizeof(EntryPtr)
+         + (entries_capacity - capacity_for(buckets)) * sizeof(Entry);
+}
+
+TABLES_COLD void
+CloseTable::compact()
+{
+    size_t buckets = compact_buckets(live_count);
+    if (buckets < table_mask + 1 || entries_length > live_count)
+        rehash(buckets - 1);
+}
+
+TABLES_COLD void
+CloseTable::enable_cards()
+{
+    if (!cards)
+        cards = new_zeroed_array<uint64_t>(card_words(entries_capacity));
+}
+
+TABLES_INLINE HashedKey
+CloseTable::hashed(KeyArg key) const
+{
+    TABLES_PHASE_START(t);
+    HashedKey hk = { key, hash(key) };
+    TABLES_PHASE(t, PhaseHash);
+    return hk;
+}
+
+TABLES_INLINE bool
+CloseTable::has(KeyArg key) const
+{
+    return has(hashed(key));
+}
+
+TABLES_INLINE bool
+CloseTable::has(HashedKey key) const
+{
+    return lookup(key) != NULL;
+}
+
+TABLES_INLINE Value
+CloseTable::get(KeyArg key) const
+{
+    return get(hashed(key));
+}
+
+TABLES_INLINE Value
+CloseTable::get(HashedKey key) const
+{
+    const Entry *e = lookup(key);
+    TABLES_PHASE_START(t);
+    Value v = e ? e->value : Value();
+    TABLES_PHASE(t, PhaseValue);
+    return v;
+}
+
+TABLES_INLINE void
+CloseTable::set(KeyArg key, ValueArg value)
+{
+    set(hashed(key), value);
+}
+
+TABLES_INLINE void
+CloseTable::set(HashedKey key, ValueArg value)
+{
+    put(key, value);
+}
+
+// Set key's value and return its entry.
+TABLES_INLINE CloseTable::Entry *
+CloseTable::put(HashedKey key, ValueArg value)
+{
+    hashcode_t h = key.hash;
+    Entry *e = lookup(key.key, h);
+    if (e) {
+        TABLES_PHASE_START(t);
+        e->value = value;
+        mark_card(cards, e - data);
+        TABLES_PHASE(t, PhaseValue);
+    } else {
+        if (entries_length == entries_capacity) {
+            // If the table is more than 1/4 deleted entries, simply rehash in
+            // place to free up some space. Otherwise, grow the table.
+            rehash(live_count >= entries_capacity - entries_capacity / 4
+                   ? double_capacity(table_mask + 1, sizeof(EntryPtr)) - 1
+                   : table_mask);
+        }
+        e = append(key, value);
+    }
+    return e;
+}
+
+// Add an entry for a key that isn't in the table to the end of the data
+// vector, which must have room for it, and return it.
+TABLES_INLINE CloseTable::Entry *
+CloseTable::append(HashedKey key, ValueArg value)
+{
+    TABLES_PHASE_START(t);
+    hashcode_t h = key.hash & table_mask;
+    live_count++;
+    Entry *e = &data[entries_length++];
+    e->key = key.key;
+    e->value = value;
+    e->chain = table[h];
+    table[h] = e;
+    mark_card(cards, e - data);
+    TABLES_PHASE(t, PhaseValue);
+    return e;
+}
+
+TABLES_INLINE bool
+CloseTable::remove(KeyArg key)
+{
+    return remove(hashed(key));
+}
+
+TABLES_INLINE bool
+CloseTable::remove(HashedKey key)
+{
+    // If an entry exists for the given key, empty it.
+    Entry *e = lookup(key.key, key.hash);
+    if (e == NULL)
+        return false;
+    TABLES_PHASE_START(t);
+    live_count--;
+    makeEmpty(e->key);
+    TABLES_PHASE(t, PhaseValue);
+    for (Range *r = ranges; r; r = r->next)
+        r->onRemove(e - data);
+
+    // If many entries have been removed, shrink the table.
+    if (table_mask > initial_buckets() && live_count < min_vector_fill(entries_length))
+        rehash(table_mask >> 1);
+    return true;
+}
+
+TABLES_INLINE void
+CloseTable::prefetch(KeyArg key) const
+{
+    prefetch(hashed(key));
+}
+
+TABLES_INLINE void
+CloseTable::prefetch(HashedKey key) const
+{
+    const EntryPtr *bucket = &table[key.hash & table_mask];
+    prefetch_address(bucket);
+    if (const Entry *e = *bucket)
+        prefetch_address(e);
+}
+
+// A removed entry stays in the data array, as a hole, until the next rehash,
+// so its index isn't reused within a generation: a handle to it fails the
+// isLive test until the rehash bumps the generation.
+TABLES_INLINE EntryHandle
+CloseTable::handle_for(const Entry *e) const
+{
+    EntryHandle handle = { NoEntry, generation };
+    if (e && size_t(e - data) < NoEntry)
+        handle.index = uint32_t(e - data);
+    return handle;
+}
+
+TABLES_INLINE CloseTable::Entry *
+CloseTable::entry_for(EntryHandle handle) const
+{
+    if (handle.index == NoEntry || handle.generation != generation
+        || handle.index >= entries_length)
+        return NULL;
+    Entry *e = &data[handle.index];
+    return isLive(e->key) ? e : NULL;
+}
+
+TABLES_INLINE EntryHandle
+CloseTable::find(KeyArg key) const
+{
+    return find(hashed(key));
+}
+
+TABLES_INLINE EntryHandle
+CloseTable::find(HashedKey key) const
+{
+    return handle_for(lookup(key));
+}
+
+TABLES_INLINE EntryHandle
+CloseTable::insert(KeyArg key, ValueArg value)
+{
+    return insert(hashed(key), value);
+}
+
+TABLES_INLINE EntryHandle
+CloseTable::insert(HashedKey key, ValueArg value)
+{
+    return handle_for(put(key, value));
+}
+
+TABLES_INLINE bool
+CloseTable::get_by_handle(EntryHandle handle, Value *value) const
+{
+    const Entry *e = entry_for(handle);
+    if (!e)
+        return false;
+    *value = e->value;
+    return true;
+}
+
+TABLES_INLINE bool
+CloseTable::set_by_handle(EntryHandle handle, ValueArg value)
+{
+    Entry *e = entry_for(handle);
+    if (!e)
+        return false;
+    e->value = value;
+    mark_card(cards, handle.index);
+    return true;
+}
+
+// The bulk-build path. A message of n entries can't be shorter than 2n
+// bytes, which bounds the header's count before anything is allocated, so a
+// corrupt header can't make us allocate a huge table.
+TABLES_COLD bool
+CloseTable::deserialize(const unsigned char *in, size_t length)
+{
+    if (live_count != 0)
+        abort();
+    const unsigned char *end = in + length;
+    uint64_t count;
+    in = read_varint(in, end, &count);
+    if (in == NULL || count > uint64_t(end - in) / 2)
+        return false;
+    size_t n = size_t(count);
+    size_t buckets = compact_buckets(n);
+    if (buckets != table_mask + 1 || entries_length != 0)
+        rehash(buckets - 1);
+
+    // Each new key has to be looked up, to reject repeats, and in a big
+    // table that is a cache miss or two. So the entries are decoded a batch
+    // at a time and their buckets prefetched before any is added, which lets
+    // the misses overlap.
+    const size_t batch = 16;
+    HashedKey keys[batch];
+    Value values[batch];
+    Key key = 0;
+    for (size_t done = 0; done < n && in; ) {
+        size_t m = n - done < batch ? n - done : batch;
+        size_t decoded = 0;
+        for (; decoded < m; decoded++) {
+            uint64_t delta;
+            in = read_varint(in, end, &delta);
+            if (in)
+                in = read_varint(in, end, &values[decoded]);
+            if (in == NULL)
+                break;
+            key += unzigzag(delta);
+            keys[decoded] = hashed(key);
+            prefetch_address(&table[keys[decoded].hash & table_mask]);
+        }
+        for (size_t i = 0; i < decoded; i++)
+            prefetch(keys[i]);
+        for (size_t i = 0; i < decoded; i++) {
+            if (!isLive(keys[i].key) || lookup(keys[i].key, keys[i].hash)) {
+                in = NULL;
+                break;
+            }
+            append(keys[i], values[i]);
+        }
+        done += m;
+    }
+    if (live_count == n && in == end)
+        return true;
+
+    live_count = 0;
+    entries_length = 0;
+    rehash(initial_buckets() - 1);
+    return false;
+}
+
+// Removed entries stay in the data array, as holes, until the next
+// rehash. These skip them in bulk.
+TABLES_INLINE size_t
+CloseTable::keys(Key *out) const
+{
+    return export_live<ExportKeys>(data, entries_length, out, live_count);
+}
+
+TABLES_INLINE size_t
+CloseTable::values(Value *out) const
+{
+    return export_live<ExportValues>(data, entries_length, out, live_count);
+}
+
+TABLES_INLINE size_t
+CloseTable::entries(KeyValue *out) const
+{
+    return export_live<ExportEntries>(data, entries_length, out, live_count);
+}
+
+// Ranges are usually locals, and GCC 12 and later warn that linking one into
+// table.ranges leaves the table pointing at a dead local. It doesn't: the
+// destructor unlinks the Range first, but the warning can't see that.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+TABLES_INLINE
+CloseTable::Range::Range(CloseTable &table)
+  : table(&table), i(0), count(0), next(table.ranges), prevp(&table.ranges)
+{
+    if (next)
+        next->prevp = &next;
+    table.ranges = this;
+    seek();
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic pop
+#endif
+
+TABLES_INLINE
+CloseTable::Range::~Range()
+{
+    *prevp = next;
+    if (next)
+        next->prevp = prevp;
+}
+
+// Skip over removed entries.
+TABLES_INLINE void
+CloseTable::Range::seek()
+{
+    while (i < table->entries_length && isEmpty(table->data[i].key))
+        i++;
+}
+
+TABLES_INLINE void
+CloseTable::Range::onRemove(size_t index)
+{
+    if (index < i)
+        count--;
+    else if (index == i)
+        seek();
+}
+
+TABLES_INLINE void
+CloseTable::Range::popFront()
+{
+    count++;
+    i++;
+    seek();
+}
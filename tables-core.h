@@ -0,0 +1,365 @@
+// tables-core.h - declarations of the in-memory hash tables: DenseTable,
+// OpenTable and CloseTable.
+//
+// There is deliberately no include guard. tables.h includes this file at
+// global scope, and tables-inline.h includes it a second time inside
+// namespace inlined, to declare a second, header-only copy of the same
+// classes (see tables-inline.h). Include tables.h, not this file, unless you
+// are making another copy; hashbench.cpp makes one, in namespace slowhash,
+// whose tables use a more expensive hash function. The tables call hash()
+// unqualified, so a copy uses the hash() of its own namespace if it has one.
+
+#ifdef HAVE_SPARSEHASH
+// === DenseTable
+// The dense_hash_map type from Google sparsehash, included to give a baseline.
+
+class DenseTable {
+private:
+    struct Hasher {
+        size_t operator()(KeyArg key) const { return hash(key); }
+    };
+
+    typedef google::dense_hash_map<Key, Value, Hasher> Map;
+    Map map;
+
+public:
+    DenseTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+
+    // dense_hash_map doesn't let us at its buckets, so this does nothing.
+    void prefetch(KeyArg key) const;
+
+    // dense_hash_map hashes keys itself, so these ignore key.hash.
+    HashedKey hashed(KeyArg key) const;
+    bool has(HashedKey key) const;
+    Value get(HashedKey key) const;
+    void set(HashedKey key, ValueArg value);
+    bool remove(HashedKey key);
+    void prefetch(HashedKey key) const;
+
+    size_t keys(Key *out) const;
+    size_t values(Value *out) const;
+    size_t entries(KeyValue *out) const;
+};
+#endif  // HAVE_SPARSEHASH
+
+
+// === OpenTable
+// A simple hash table with open addressing.
+// See <https://en.wikipedia.org/wiki/Hash_table#Open_addressing>.
+//
+class OpenTable {
+    struct Entry {
+        Key key;
+        Value value;
+
+        Entry() { makeEmpty(key); }
+    };
+
+    Entry *table;           // power-of-2-sized flat hash table
+    size_t live_count;      // number of live entries
+    size_t nonempty_count;  // number of live and tombstone entries
+    size_t mask;            // size of table, in elements, minus 1
+    uint64_t *cards;        // card marks, or NULL (see enable_cards)
+
+    // The fill ratio is kept between 1/4 and 3/4. These are computed in
+    // integer arithmetic so that they are exact for any capacity (a double
+    // can't represent every size_t).
+    static size_t min_fill(size_t capacity) { return capacity / 4; }
+    static size_t max_fill(size_t capacity) { return capacity - capacity / 4; }
+
+    // The smallest capacity that holds n entries.
+    static size_t compact_capacity(size_t n) {
+        size_t capacity = 8;
+        while (max_fill(capacity) < n)
+            capacity *= 2;
+        return capacity;
+    }
+
+    inline Entry * lookup(HashedKey key);
+    inline const Entry * lookup(HashedKey key) const;
+
+    void rehash(size_t new_capacity);
+    void trace_probe_length(HashedKey key) const;
+
+public:
+    OpenTable();
+    ~OpenTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+    void prefetch(KeyArg key) const;
+
+    HashedKey hashed(KeyArg key) const;
+    bool has(HashedKey key) const;
+    Value get(HashedKey key) const;
+    void set(HashedKey key, ValueArg value);
+    bool remove(HashedKey key);
+    void prefetch(HashedKey key) const;
+
+    size_t keys(Key *out) const;
+    size_t values(Value *out) const;
+    size_t entries(KeyValue *out) const;
+
+    // Slack: the bytes the table holds beyond the smallest array its live
+    // entries fit in. compact() rehashes into that array, giving the slack
+    // back; the next insert may have to grow it again. MemoryBudget (see
+    // tables.h) calls these under memory pressure.
+    size_t slack_bytes() const;
+    void compact();
+
+    // Card marking, for tables whose values are GC pointers (see tables.h).
+    // enable_cards() starts with every card clean; after that set() marks
+    // the card of the slot it writes. scan_dirty_cards(f) calls
+    // f(key, value &) for each live entry on a dirty card, cleans the cards
+    // and returns how many were dirty.
+    void enable_cards();
+    bool cards_enabled() const { return cards != NULL; }
+
+    template <class F>
+    size_t scan_dirty_cards(F &f) {
+        return cards ? scan_dirty_card_entries(cards, table, mask + 1, f) : 0;
+    }
+
+    // Slot-range access, for scans split across threads (see
+    // parallel_for_chunks in tables.h). scan_slots(begin, end, f) calls
+    // f(key, value) for each live entry in slots [begin, end) of
+    // [0, slot_count()). The table must not change while a scan is running.
+    size_t slot_count() const { return mask + 1; }
+
+    template <class F>
+    void scan_slots(size_t begin, size_t end, F &f) const {
+        for (const Entry *e = table + begin, *stop = table + end; e != stop; e++) {
+            if (isLive(e->key))
+                f(e->key, e->value);
+        }
+    }
+};
+
+
+// === CloseTable
+// A vector combined with a very simple hash table for fast lookup.
+// Tyler Close proposed this.
+//
+class CloseTable {
+private:
+    // The number of buckets in the table initially.
+    // This must be a power of two.
+    static size_t initial_buckets() { return 4; }
+
+    // The maximum load factor (mean number of entries per bucket) is 8/3.
+    // It is an invariant that
+    //     entries_capacity == capacity_for(table_mask + 1)
+    //                      == floor((table_mask + 1) * 8 / 3).
+    //
+    // This fill factor was chosen to make the size of the entries
+    // array, in bytes, close to a power of two. (sizeof(Entry)
+    // is 24 on both 32-bit and 64-bit systems.)
+    //
+    // The product is computed piecewise so that it can't overflow.
+    static size_t capacity_for(size_t buckets) {
+        return buckets / 3 * 8 + buckets % 3 * 8 / 3;
+    }
+
+    // The minimum permitted value of (live_count / entries_length) is 1/4.
+    // If that ratio drops below this value, we shrink the table.
+    // Return the smallest live_count that satisfies it.
+    static size_t min_vector_fill(size_t length) {
+        return length / 4 + (length % 4 != 0);
+    }
+
+    // The smallest number of buckets whose entries array holds n entries.
+    static size_t compact_buckets(size_t n) {
+        size_t buckets = initial_buckets();
+        while (capacity_for(buckets) < n)
+            buckets *= 2;
+        return buckets;
+    }
+
+    struct Entry {
+        Key key;
+        Value value;
+        Entry *chain;
+    };
+
+    typedef Entry *EntryPtr;
+
+public:
+    class Range;
+
+private:
+    EntryPtr *table;            // power-of-2-sized hash table
+    size_t table_mask;          // size of table, in elements, minus one
+    Entry *data;                // data vector, an array of Entry objects
+    size_t entries_capacity;    // size of data, in elements
+    size_t entries_length;      // number of initialized entries
+    size_t live_count;          // entries_length less empty (removed) entries
+    Range *ranges;              // linked list of live Ranges on this table
+    uint32_t generation;        // bumped by every rehash, which moves entries;
+                                // wraps after 2^32 rehashes
+    uint64_t *cards;            // card marks for data, or NULL
+
+    // The index find() gives absent keys, and entries past the first 4G.
+    static const uint32_t NoEntry = 0xffffffff;
+
+    inline Entry * lookup(KeyArg key, hashcode_t h);
+    inline const Entry * lookup(HashedKey key) const;
+    inline Entry * put(HashedKey key, ValueArg value);
+    inline Entry * append(HashedKey key, ValueArg value);
+    inline EntryHandle handle_for(const Entry *e) const;
+    inline Entry * entry_for(EntryHandle handle) const;
+    void rehash(size_t new_table_mask);
+    void trace_chain_length(KeyArg key, hashcode_t h) const;
+
+public:
+    CloseTable();
+    ~CloseTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+
+    // Prefetch the key's bucket and the first entry in its chain. Finding
+    // that entry means reading the bucket; the CPU doesn't have to stall for
+    // it, since nothing but the prefetch depends on the result.
+    void prefetch(KeyArg key) const;
+
+    HashedKey hashed(KeyArg key) const;
+    bool has(HashedKey key) const;
+    Value get(HashedKey key) const;
+    void set(HashedKey key, ValueArg value);
+    bool remove(HashedKey key);
+    void prefetch(HashedKey key) const;
+
+    size_t keys(Key *out) const;
+    size_t values(Value *out) const;
+    size_t entries(KeyValue *out) const;
+
+    // Handles, for callers that look a key up once and then read or write
+    // its value many times. find() returns a handle to key's entry, or one
+    // that get_by_handle() rejects if key is absent; insert() is set() that
+    // returns a handle to the entry it set.
+    EntryHandle find(KeyArg key) const;
+    EntryHandle find(HashedKey key) const;
+    EntryHandle insert(KeyArg key, ValueArg value);
+    EntryHandle insert(HashedKey key, ValueArg value);
+    bool get_by_handle(EntryHandle handle, Value *value) const;
+    bool set_by_handle(EntryHandle handle, ValueArg value);
+
+    // Slack, as for OpenTable: surplus buckets and entries capacity only.
+    // compact() also squeezes out the holes that removed entries leave in
+    // the data vector, which, for a large array, gives their pages back even
+    // if the table doesn't shrink; but that doesn't change byte_size(), so
+    // slack_bytes() doesn't count the holes.
+    size_t slack_bytes() const;
+    void compact();
+
+    // Card marking, as for OpenTable. The cards cover the data vector, so
+    // set(), insert() and set_by_handle() mark the card of the entry they
+    // write, and a rehash, which squeezes out removed entries, moves each
+    // mark along with its entry.
+    void enable_cards();
+    bool cards_enabled() const { return cards != NULL; }
+
+    template <class F>
+    size_t scan_dirty_cards(F &f) {
+        return cards ? scan_dirty_card_entries(cards, data, entries_length, f) : 0;
+    }
+
+    // Serialization, in the wire format described in tables.h.
+    // serialize(sink) streams the live entries, in insertion order, to
+    // sink.write(const unsigned char *bytes, size_t n), in chunks of at most
+    // WireChunkBytes, without building the whole message first.
+    // deserialize(in, length) fills an empty table from a whole message. It
+    // sizes the table once, from the header, and then adds each entry to the
+    // end of the data vector with no further growth checks. It returns false,
+    // leaving the table empty, if the message is malformed: truncated,
+    // with bytes left over, or with a reserved or repeated key.
+    static const size_t WireChunkBytes = 4096;
+
+    template <class Sink>
+    void serialize(Sink &sink) const {
+        unsigned char buf[WireChunkBytes];
+        unsigned char *p = write_varint(buf, live_count);
+        Key prev = 0;
+        for (const Entry *e = data, *end = data + entries_length; e != end; e++) {
+            if (isEmpty(e->key))
+                continue;
+            if (size_t(buf + WireChunkBytes - p) < 2 * MaxVarintBytes) {
+                sink.write(buf, size_t(p - buf));
+                p = buf;
+            }
+            p = write_varint(p, zigzag(e->key - prev));
+            p = write_varint(p, e->value);
+            prev = e->key;
+        }
+        sink.write(buf, size_t(p - buf));
+    }
+
+    bool deserialize(const unsigned char *in, size_t length);
+
+    // Slot-range access, as for OpenTable. The slots are the entries in
+    // insertion order, so a scan that merges its chunks' results in order
+    // sees them in the same order as a Range does.
+    size_t slot_count() const { return entries_length; }
+
+    template <class F>
+    void scan_slots(size_t begin, size_t end, F &f) const {
+        for (const Entry *e = data + begin, *stop = data + end; e != stop; e++) {
+            if (!isEmpty(e->key))
+                f(e->key, e->value);
+        }
+    }
+
+    // A cursor over the live entries, in insertion order. The table may be
+    // modified while a Range is live, with the semantics of Map.prototype.forEach:
+    // entries added before the Range reaches the end are visited, and removed
+    // entries are not. Removing the front entry moves the Range on to the next
+    // one, so a forEach loop should take the front entry and call popFront()
+    // before running code that may modify the table.
+    //
+    // To make this work, the table keeps a list of its Ranges. Each Range
+    // counts the live entries before it; remove() keeps that count up to date,
+    // and when rehash() squeezes out the removed entries, the count is exactly
+    // the Range's new position. So a Range never has to start over.
+    //
+    // A Range must not outlive its table.
+    class Range {
+        friend class CloseTable;
+
+        CloseTable *table;
+        size_t i;           // index of the front entry in table->data
+        size_t count;       // number of live entries before entries[i]
+        Range *next;        // next Range in table->ranges
+        Range **prevp;      // the pointer that points to this Range
+
+        void seek();
+        void onRemove(size_t index);
+        void onCompact() { i = count; }
+
+        Range(const Range &);           // not copyable
+        void operator=(const Range &);
+
+    public:
+        explicit Range(CloseTable &table);
+        ~Range();
+
+        bool empty() const { return i >= table->entries_length; }
+        Key front_key() const { return table->data[i].key; }
+        Value front_value() const { return table->data[i].value; }
+        void popFront();
+    };
+};
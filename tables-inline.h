@@ -0,0 +1,36 @@
+// tables-inline.h - header-only copies of the in-memory hash tables.
+//
+// tables.cpp compiles DenseTable, OpenTable and CloseTable out of line, so
+// every has/get/set in a benchmark loop is a real call. This header compiles
+// the very same source a second time, inside namespace inlined, with the hot
+// methods forced inline, so that hashbench can run the two side by side and
+// show what the call boundary costs (hashbench -i).
+//
+// MmapTable and VersionedCloseTable have no inlined versions.
+
+#ifndef tables_inline_h_
+#define tables_inline_h_
+
+#include "tables.h"
+#include <cstring>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#define TABLES_INLINE __forceinline
+#else
+#define TABLES_INLINE inline __attribute__((always_inline))
+#endif
+#define TABLES_COLD inline
+
+namespace inlined {
+#include "tables-core.h"
+#include "tables-core-inl.h"
+}
+
+#undef TABLES_INLINE
+#undef TABLES_COLD
+
+#endif  // tables_inline_h_
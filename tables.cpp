@@ -1,309 +1,2289 @@
 #include "tables.h"
 #include <cstring>
+#ifdef HAVE_PTHREADS
+#include <sched.h>
+#endif
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
+// The table engines are defined in tables-core-inl.h, so that
+// tables-inline.h can compile the same code again with everything inlined.
+// Here they are ordinary out-of-line functions.
+#define TABLES_INLINE
+#define TABLES_COLD
+#include "tables-core-inl.h"
 
-// === OpenTable
+#ifdef HAVE_SDT
+#define TABLES_DEFINE_PROBE(name) \
+    volatile unsigned short TABLES_SEMAPHORE(name) __attribute__((section(".probes"))) = 0
+TABLES_DEFINE_PROBE(open_rehash);
+TABLES_DEFINE_PROBE(open_shrink);
+TABLES_DEFINE_PROBE(close_rehash);
+TABLES_DEFINE_PROBE(close_shrink);
+TABLES_DEFINE_PROBE(close_compact);
+TABLES_DEFINE_PROBE(open_long_probe);
+TABLES_DEFINE_PROBE(close_long_chain);
+#undef TABLES_DEFINE_PROBE
+#endif
 
-OpenTable::OpenTable() {
-    table = new Entry[8];
-    mask = 7;
+#ifdef HAVE_PHASE_TIMING
+PhaseCounters phase_counters;
+#endif
+
+
+// === ShapeTable
+
+size_t
+ShapeTable::Shape::find(KeyArg key) const
+{
+    if (length == 0)
+        return NotFound;
+    for (size_t i = hash(key) & index_mask; index[i] != 0; i = (i + 1) & index_mask) {
+        if (keys[index[i] - 1] == key)
+            return index[i] - 1;
+    }
+    return NotFound;
+}
+
+ShapeTable::Tree::Tree()
+{
+    memset(&root, 0, sizeof(root));
+    root.tree = this;
+}
+
+ShapeTable::Tree::~Tree()
+{
+    destroy_children(&root);
+}
+
+void
+ShapeTable::Tree::destroy_children(Shape *s)
+{
+    Shape *c = s->children;
+    while (c) {
+        Shape *next = c->next_sibling;
+        destroy_children(c);
+        delete[] c->keys;
+        delete[] c->index;
+        delete c;
+        c = next;
+    }
+}
+
+ShapeTable::Tree &
+ShapeTable::Tree::shared()
+{
+    static Tree tree;
+    return tree;
+}
+
+// Return the shape for s plus key, or NULL if the table should fall back.
+ShapeTable::Shape *
+ShapeTable::Tree::add(const Shape *s, KeyArg key)
+{
+    Shape *parent = const_cast<Shape *>(s);
+    for (Shape *c = parent->children; c; c = c->next_sibling) {
+        if (c->keys[c->length - 1] == key)
+            return c;
+    }
+    if (parent->length == MaxKeys || parent->child_count == MaxTransitions)
+        return NULL;
+
+    // The index is at most half full, so that probes stay short.
+    size_t length = parent->length + 1;
+    size_t index_size = 2;
+    while (index_size < length * 2)
+        index_size *= 2;
+
+    Shape *c = new Shape;
+    c->tree = this;
+    c->parent = parent;
+    c->children = NULL;
+    c->child_count = 0;
+    c->length = length;
+    c->keys = new Key[length];
+    for (size_t i = 0; i < parent->length; i++)
+        c->keys[i] = parent->keys[i];
+    c->keys[length - 1] = key;
+    c->index = new uint8_t[index_size];
+    memset(c->index, 0, index_size);
+    c->index_mask = index_size - 1;
+    for (size_t k = 0; k < length; k++) {
+        size_t i = hash(c->keys[k]) & c->index_mask;
+        while (c->index[i] != 0)
+            i = (i + 1) & c->index_mask;
+        c->index[i] = uint8_t(k + 1);
+    }
+
+    c->next_sibling = parent->children;
+    parent->children = c;
+    parent->child_count++;
+    return c;
+}
+
+size_t
+ShapeTable::Tree::subtree_bytes(const Shape *s)
+{
+    size_t bytes = 0;
+    for (const Shape *c = s->children; c; c = c->next_sibling)
+        bytes += sizeof(Shape) + c->length * sizeof(Key) + c->index_mask + 1 + subtree_bytes(c);
+    return bytes;
+}
+
+size_t
+ShapeTable::Tree::byte_size() const
+{
+    return sizeof(*this) + subtree_bytes(&root);
+}
+
+size_t
+ShapeTable::values_capacity(size_t length)
+{
+    size_t capacity = 0;
+    if (length > 0) {
+        capacity = 1;
+        while (capacity < length)
+            capacity *= 2;
+    }
+    return capacity;
+}
+
+ShapeTable::ShapeTable()
+  : shape(&Tree::shared().root), values(NULL), dict(NULL)
+{
+}
+
+ShapeTable::ShapeTable(Tree &tree)
+  : shape(&tree.root), values(NULL), dict(NULL)
+{
+}
+
+ShapeTable::~ShapeTable()
+{
+    delete[] values;
+    delete dict;
+}
+
+// Move everything into a CloseTable, in the same order.
+void
+ShapeTable::fall_back()
+{
+    dict = new CloseTable;
+    for (size_t i = 0; i < shape->length; i++)
+        dict->set(shape->keys[i], values[i]);
+    delete[] values;
+    values = NULL;
+    shape = NULL;
+}
+
+size_t
+ShapeTable::byte_size(ByteSizeOption option) const
+{
+    if (dict)
+        return sizeof(*this) + dict->byte_size(option);
+    return sizeof(*this) + (option == BytesAllocated ? values_capacity(shape->length)
+                                                     : shape->length) * sizeof(Value);
+}
+
+size_t
+ShapeTable::size() const
+{
+    return dict ? dict->size() : shape->length;
+}
+
+bool
+ShapeTable::has(KeyArg key) const
+{
+    return dict ? dict->has(key) : shape->find(key) != Shape::NotFound;
+}
+
+Value
+ShapeTable::get(KeyArg key) const
+{
+    if (dict)
+        return dict->get(key);
+    size_t i = shape->find(key);
+    return i == Shape::NotFound ? Value() : values[i];
+}
+
+void
+ShapeTable::set(KeyArg key, ValueArg value)
+{
+    if (dict) {
+        dict->set(key, value);
+        return;
+    }
+    size_t i = shape->find(key);
+    if (i != Shape::NotFound) {
+        values[i] = value;
+        return;
+    }
+
+    const Shape *next = shape->tree->add(shape, key);
+    if (!next) {
+        fall_back();
+        dict->set(key, value);
+        return;
+    }
+    size_t length = shape->length;
+    if (length == values_capacity(length)) {
+        Value *new_values = new Value[values_capacity(length + 1)];
+        for (size_t j = 0; j < length; j++)
+            new_values[j] = values[j];
+        delete[] values;
+        values = new_values;
+    }
+    values[length] = value;
+    shape = next;
+}
+
+bool
+ShapeTable::remove(KeyArg key)
+{
+    if (!dict) {
+        if (shape->find(key) == Shape::NotFound)
+            return false;
+        fall_back();
+    }
+    return dict->remove(key);
+}
+
+
+// === FrozenTable
+
+static unsigned
+popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+    return unsigned(__builtin_popcountll(x));
+#else
+    unsigned n = 0;
+    for (; x; x &= x - 1)
+        n++;
+    return n;
+#endif
+}
+
+// Return the index of the lowest 1 bit of x, which must not be zero.
+static unsigned
+lowest_bit64(uint64_t x)
+{
+#ifdef __GNUC__
+    return unsigned(__builtin_ctzll(x));
+#else
+    unsigned n = 0;
+    for (; !(x & 1); x >>= 1)
+        n++;
+    return n;
+#endif
+}
+
+unsigned
+FrozenTable::low_bits_for(size_t n, Key max_key)
+{
+    unsigned l = 0;
+    if (n != 0) {
+        for (Key ratio = max_key / n; ratio > 1; ratio >>= 1)
+            l++;
+    }
+    return l;
+}
+
+size_t
+FrozenTable::upper_bits_for(size_t n, Key max_key)
+{
+    return n + size_t(max_key >> low_bits_for(n, max_key)) + 1;
+}
+
+size_t
+FrozenTable::byte_size_for(size_t n, Key max_key)
+{
+    size_t upper_bits = upper_bits_for(n, max_key);
+    size_t zeros = upper_bits - n;
+    return sizeof(FrozenTable)
+        + words_for(n * low_bits_for(n, max_key)) * sizeof(uint64_t)
+        + words_for(upper_bits) * sizeof(uint64_t)
+        + (zeros / ZeroSampleRate + 1) * sizeof(size_t)
+        + n * sizeof(Value);
+}
+
+FrozenTable::FrozenTable(const Key *keys, const Value *vals, size_t n)
+  : length(n), max_key(n ? keys[n - 1] : 0)
+{
+    low_bits = low_bits_for(n, max_key);
+    upper_bits = upper_bits_for(n, max_key);
+    lower = new_zeroed_array<uint64_t>(words_for(n * low_bits));
+    upper = new_zeroed_array<uint64_t>(words_for(upper_bits));
+    values = new_array<Value>(n);
+
+    uint64_t low_mask = (uint64_t(1) << low_bits) - 1;
+    for (size_t i = 0; i < n; i++) {
+        if (!isLive(keys[i]) || (i > 0 && keys[i] <= keys[i - 1]))
+            abort();
+        uint64_t low = keys[i] & low_mask;
+        size_t bit = i * low_bits;
+        if (low_bits) {
+            lower[bit / 64] |= low << (bit % 64);
+            if (bit % 64 + low_bits > 64)
+                lower[bit / 64 + 1] |= low >> (64 - bit % 64);
+        }
+        size_t u = size_t(keys[i] >> low_bits) + i;
+        upper[u / 64] |= uint64_t(1) << (u % 64);
+        values[i] = vals[i];
+    }
+
+    size_t zeros = upper_bits - n;
+    zero_samples = new_array<size_t>(zeros / ZeroSampleRate + 1);
+    for (size_t p = 0, z = 0; p < upper_bits; p++) {
+        if (!(upper[p / 64] >> (p % 64) & 1)) {
+            if (z % ZeroSampleRate == 0)
+                zero_samples[z / ZeroSampleRate] = p;
+            z++;
+        }
+    }
+}
+
+FrozenTable::~FrozenTable()
+{
+    delete_array(lower, words_for(length * low_bits));
+    delete_array(upper, words_for(upper_bits));
+    delete_array(zero_samples, (upper_bits - length) / ZeroSampleRate + 1);
+    delete_array(values, length);
+}
+
+uint64_t
+FrozenTable::lower_at(size_t i) const
+{
+    if (low_bits == 0)
+        return 0;
+    size_t bit = i * low_bits;
+    uint64_t x = lower[bit / 64] >> (bit % 64);
+    if (bit % 64 + low_bits > 64)
+        x |= lower[bit / 64 + 1] << (64 - bit % 64);
+    return x & ((uint64_t(1) << low_bits) - 1);
+}
+
+// Return the position in upper of the jth 0 bit, counting from 0.
+size_t
+FrozenTable::select_zero(size_t j) const
+{
+    size_t p = zero_samples[j / ZeroSampleRate];
+    size_t remaining = j % ZeroSampleRate;
+    size_t w = p / 64;
+    uint64_t zeros = ~upper[w] & (~uint64_t(0) << (p % 64));
+    for (;;) {
+        unsigned c = popcount64(zeros);
+        if (remaining < c)
+            break;
+        remaining -= c;
+        zeros = ~upper[++w];
+    }
+    for (; remaining; remaining--)
+        zeros &= zeros - 1;
+    return w * 64 + lowest_bit64(zeros);
+}
+
+// Return the rank of key, or NotFound.
+size_t
+FrozenTable::rank_of(KeyArg key) const
+{
+    if (length == 0 || key > max_key)
+        return NotFound;
+    size_t h = size_t(key >> low_bits);
+    uint64_t low = key & ((uint64_t(1) << low_bits) - 1);
+
+    // The keys with high part h start just after the (h-1)th 0 bit. Each 0
+    // before position p is a high part, so p - h keys come before it.
+    size_t p = h == 0 ? 0 : select_zero(h - 1) + 1;
+    for (size_t i = p - h; p < upper_bits && (upper[p / 64] >> (p % 64) & 1); p++, i++) {
+        uint64_t x = lower_at(i);
+        if (x == low)
+            return i;
+        if (x > low)
+            break;
+    }
+    return NotFound;
+}
+
+size_t
+FrozenTable::byte_size(ByteSizeOption) const
+{
+    return byte_size_for(length, max_key);
+}
+
+size_t
+FrozenTable::size() const
+{
+    return length;
+}
+
+bool
+FrozenTable::has(KeyArg key) const
+{
+    return rank_of(key) != NotFound;
+}
+
+Value
+FrozenTable::get(KeyArg key) const
+{
+    size_t i = rank_of(key);
+    return i == NotFound ? Value() : values[i];
+}
+
+
+// === QuotientTable
+
+// MurmurHash3's 64-bit finalizer. Each step is invertible: an xor with a
+// right shift of 33 or more undoes itself, and the multipliers are odd.
+uint64_t
+QuotientTable::perm(Key key)
+{
+    uint64_t p = key;
+    p ^= p >> 33;
+    p *= 0xff51afd7ed558ccdull;
+    p ^= p >> 33;
+    p *= 0xc4ceb9fe1a85ec53ull;
+    p ^= p >> 33;
+    return p;
+}
+
+Key
+QuotientTable::unperm(uint64_t p)
+{
+    p ^= p >> 33;
+    p *= 0x9cb4b2f8129337dbull;     // inverse of 0xc4ceb9fe1a85ec53 mod 2^64
+    p ^= p >> 33;
+    p *= 0x4f74430c22a54005ull;     // inverse of 0xff51afd7ed558ccd mod 2^64
+    p ^= p >> 33;
+    return p;
+}
+
+// A record is a distance byte, then the quotient, then the value, unaligned.
+// Reading the quotient reads 8 bytes and masks off the ones past it, which
+// belong to the value.
+uint64_t
+QuotientTable::load_quotient(const uint8_t *r, unsigned bytes)
+{
+    uint64_t q;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    q = 0;
+    for (unsigned j = 0; j < bytes; j++)
+        q |= uint64_t(r[1 + j]) << (8 * j);
+    return q;
+#else
+    memcpy(&q, r + 1, sizeof(q));
+    return bytes == 8 ? q : q & ((uint64_t(1) << (8 * bytes)) - 1);
+#endif
+}
+
+void
+QuotientTable::set_quotient(uint8_t *r, uint64_t q) const
+{
+    for (unsigned j = 0; j < quotient_bytes; j++)
+        r[1 + j] = uint8_t(q >> (8 * j));
+}
+
+// Return perm(key) for the key of the entry in slot i.
+uint64_t
+QuotientTable::perm_at(size_t i) const
+{
+    const uint8_t *r = record(i);
+    size_t home = (i - (r[0] - 1)) & mask;
+    return quotient_at(r) << shift | home;
+}
+
+Value
+QuotientTable::value_at(size_t i) const
+{
+    Value v;
+    memcpy(&v, record(i) + 1 + quotient_bytes, sizeof(v));
+    return v;
+}
+
+QuotientTable::QuotientTable()
+  : mask(7), shift(3), quotient_bytes(8), record_size(1 + 8 + sizeof(Value)), live_count(0)
+{
+    slots = new_zeroed_array<uint8_t>((mask + 1) * record_size);
+}
+
+QuotientTable::~QuotientTable()
+{
+    delete_array(slots, (mask + 1) * record_size);
+}
+
+// Return the slot holding key, or NotFound. d is the distance from the home
+// slot plus one, as stored. An empty slot has d == 0, so one test covers it
+// and the Robin Hood early exit.
+size_t
+QuotientTable::find(KeyArg key) const
+{
+    uint64_t p = perm(key);
+    uint64_t q = p >> shift;
+    size_t i = size_t(p) & mask;
+    for (unsigned d = 1; ; d++) {
+        const uint8_t *r = record(i);
+        if (r[0] < d)
+            return NotFound;
+        if (r[0] == d && quotient_at(r) == q)
+            return i;
+        i = (i + 1) & mask;
+    }
+}
+
+// Insert the entry for p, which must not be in the table, Robin Hood style.
+// If some entry would end up too far from home to record its distance,
+// return false, leaving that entry (which may not be the one we started
+// with) in p and value; the caller must grow the table and insert it there.
+bool
+QuotientTable::insert(uint64_t &p, Value &value)
+{
+    uint8_t carry[1 + 8 + sizeof(Value)], displaced[1 + 8 + sizeof(Value)];
+    carry[0] = 1;
+    set_quotient(carry, p >> shift);
+    memcpy(carry + 1 + quotient_bytes, &value, sizeof(value));
+
+    size_t i = size_t(p) & mask;
+    for (;;) {
+        uint8_t *r = record(i);
+        if (r[0] == 0) {
+            memcpy(r, carry, record_size);
+            live_count++;
+            return true;
+        }
+        if (r[0] < carry[0]) {
+            memcpy(displaced, r, record_size);
+            memcpy(r, carry, record_size);
+            memcpy(carry, displaced, record_size);
+        }
+        i = (i + 1) & mask;
+        if (carry[0] == MaxDistance + 1) {
+            size_t home = (i - MaxDistance - 1) & mask;
+            p = quotient_at(carry) << shift | home;
+            memcpy(&value, carry + 1 + quotient_bytes, sizeof(value));
+            return false;
+        }
+        carry[0]++;
+    }
+}
+
+// Move every entry into a new array of new_capacity slots. If one of them
+// won't fit, give up, leaving the table as it was, and return false.
+bool
+QuotientTable::try_rehash(size_t new_capacity)
+{
+    uint8_t *old_slots = slots;
+    size_t old_mask = mask;
+    unsigned old_shift = shift, old_quotient_bytes = quotient_bytes;
+    size_t old_record_size = record_size;
+    size_t old_live_count = live_count;
+
+    mask = new_capacity - 1;
+    shift = 0;
+    while ((size_t(1) << shift) < new_capacity)
+        shift++;
+    quotient_bytes = (64 - shift + 7) / 8;
+    record_size = 1 + quotient_bytes + sizeof(Value);
+    slots = new_zeroed_array<uint8_t>(new_capacity * record_size);
+    live_count = 0;
+
+    for (size_t i = 0; i <= old_mask; i++) {
+        const uint8_t *r = old_slots + i * old_record_size;
+        if (r[0] == 0)
+            continue;
+
+        // perm_at() and value_at(), for the old layout.
+        uint64_t q = load_quotient(r, old_quotient_bytes);
+        uint64_t p = q << old_shift | ((i - (r[0] - 1)) & old_mask);
+        Value v;
+        memcpy(&v, r + 1 + old_quotient_bytes, sizeof(v));
+
+        if (!insert(p, v)) {
+            delete_array(slots, new_capacity * record_size);
+            slots = old_slots;
+            mask = old_mask;
+            shift = old_shift;
+            quotient_bytes = old_quotient_bytes;
+            record_size = old_record_size;
+            live_count = old_live_count;
+            return false;
+        }
+    }
+    delete_array(old_slots, (old_mask + 1) * old_record_size);
+    return true;
+}
+
+// Rehash, doubling new_capacity until everything fits. With the fill ratio
+// capped at 7/8 and keys mixed by perm(), that has never been seen to need
+// a second try.
+void
+QuotientTable::rehash(size_t new_capacity)
+{
+    while (!try_rehash(new_capacity))
+        new_capacity = double_capacity(new_capacity, record_size);
+}
+
+size_t
+QuotientTable::byte_size(ByteSizeOption) const
+{
+    return sizeof(*this) + (mask + 1) * record_size;
+}
+
+size_t
+QuotientTable::size() const
+{
+    return live_count;
+}
+
+bool
+QuotientTable::has(KeyArg key) const
+{
+    return find(key) != NotFound;
+}
+
+Value
+QuotientTable::get(KeyArg key) const
+{
+    size_t i = find(key);
+    return i == NotFound ? Value() : value_at(i);
+}
+
+void
+QuotientTable::set(KeyArg key, ValueArg value)
+{
+    size_t i = find(key);
+    if (i != NotFound) {
+        memcpy(record(i) + 1 + quotient_bytes, &value, sizeof(value));
+        return;
+    }
+
+    if (live_count + 1 > max_fill(mask + 1))
+        rehash(double_capacity(mask + 1, record_size));
+    uint64_t p = perm(key);
+    Value v = value;
+    while (!insert(p, v))
+        rehash(double_capacity(mask + 1, record_size));
+}
+
+bool
+QuotientTable::remove(KeyArg key)
+{
+    size_t i = find(key);
+    if (i == NotFound)
+        return false;
+
+    // Shift the entries after it back a slot, up to the next one that is
+    // empty or already home.
+    for (;;) {
+        size_t j = (i + 1) & mask;
+        const uint8_t *next = record(j);
+        if (next[0] <= 1)
+            break;
+        uint8_t *r = record(i);
+        memcpy(r, next, record_size);
+        r[0]--;
+        i = j;
+    }
+    record(i)[0] = 0;
+    live_count--;
+
+    if (mask > 7 && live_count < min_fill(mask + 1))
+        rehash((mask + 1) >> 1);
+    return true;
+}
+
+void
+QuotientTable::prefetch(KeyArg key) const
+{
+    prefetch_address(record(size_t(perm(key)) & mask));
+}
+
+size_t
+QuotientTable::keys(Key *out) const
+{
+    size_t j = 0;
+    for (size_t i = 0; i <= mask; i++) {
+        if (record(i)[0] != 0)
+            out[j++] = unperm(perm_at(i));
+    }
+    return j;
+}
+
+size_t
+QuotientTable::values(Value *out) const
+{
+    size_t j = 0;
+    for (size_t i = 0; i <= mask; i++) {
+        if (record(i)[0] != 0)
+            out[j++] = value_at(i);
+    }
+    return j;
+}
+
+size_t
+QuotientTable::entries(KeyValue *out) const
+{
+    size_t j = 0;
+    for (size_t i = 0; i <= mask; i++) {
+        if (record(i)[0] != 0) {
+            KeyValue kv = { unperm(perm_at(i)), value_at(i) };
+            out[j++] = kv;
+        }
+    }
+    return j;
+}
+
+
+// === FreezableTable
+
+FreezePolicy::FreezePolicy(unsigned cold_after)
+  : tables(NULL), sweeps(0), cold_after(cold_after)
+{
+}
+
+FreezePolicy::~FreezePolicy()
+{
+    // Any tables still around just stop freezing.
+    for (FreezableTable *t = tables; t; t = t->next)
+        t->policy = NULL;
+}
+
+size_t
+FreezePolicy::sweep()
+{
+    sweeps++;
+    size_t n = 0;
+    for (FreezableTable *t = tables; t; t = t->next) {
+        if (!t->frozen && sweeps - t->last_write >= cold_after) {
+            t->freeze();
+            n += t->frozen != NULL;
+        }
+    }
+    return n;
+}
+
+FreezableTable::FreezableTable(FreezePolicy *policy)
+  : table(new CloseTable), frozen(NULL), frozen_length(0), index_bits(0),
+    policy(policy), last_write(0), next(NULL), prevp(NULL)
+{
+    if (policy) {
+        last_write = policy->sweeps;
+        next = policy->tables;
+        prevp = &policy->tables;
+        if (next)
+            next->prevp = &next;
+        policy->tables = this;
+    }
+}
+
+FreezableTable::~FreezableTable()
+{
+    if (policy) {
+        *prevp = next;
+        if (next)
+            next->prevp = prevp;
+    }
+    delete table;
+    delete[] frozen;
+}
+
+// Fibonacci hashing: hash() may be the identity, and the index needs its
+// top bits mixed.
+size_t
+FreezableTable::index_slot(KeyArg key, unsigned bits)
+{
+    return size_t((uint64_t(hash(key)) * 0x9e3779b97f4a7c15ull) >> (64 - bits));
+}
+
+const KeyValue *
+FreezableTable::find_frozen(KeyArg key) const
+{
+    const KeyValue *entries = frozen_entries();
+    const uint32_t *index = frozen_index();
+    size_t mask = (size_t(1) << index_bits) - 1;
+    for (size_t s = index_slot(key, index_bits); index[s] != 0; s = (s + 1) & mask) {
+        const KeyValue *e = &entries[index[s] - 1];
+        if (e->key == key)
+            return e;
+    }
+    return NULL;
+}
+
+void
+FreezableTable::freeze()
+{
+    size_t n = table->size();
+    if (n >= 0xffffffff)
+        return;     // too big for 32-bit entry numbers; stay mutable
+
+    // Keep the index at most 3/4 full.
+    unsigned bits = 1;
+    while ((size_t(1) << bits) < n + n / 3 + 1)
+        bits++;
+    size_t slots = size_t(1) << bits;
+    uint8_t *block = new uint8_t[n * sizeof(KeyValue) + slots * sizeof(uint32_t)];
+    KeyValue *entries = (KeyValue *) block;
+    table->entries(entries);
+    uint32_t *index = (uint32_t *) (block + n * sizeof(KeyValue));
+    memset(index, 0, slots * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        size_t s = index_slot(entries[i].key, bits);
+        while (index[s] != 0)
+            s = (s + 1) & (slots - 1);
+        index[s] = uint32_t(i + 1);
+    }
+
+    delete table;
+    table = NULL;
+    frozen = block;
+    frozen_length = n;
+    index_bits = bits;
+}
+
+void
+FreezableTable::thaw()
+{
+    table = new CloseTable;
+    const KeyValue *entries = frozen_entries();
+    for (size_t i = 0; i < frozen_length; i++)
+        table->set(entries[i].key, entries[i].value);
+    delete[] frozen;
+    frozen = NULL;
+    frozen_length = 0;
+    index_bits = 0;
+}
+
+void
+FreezableTable::will_write()
+{
+    if (frozen)
+        thaw();
+    if (policy)
+        last_write = policy->sweeps;
+}
+
+size_t
+FreezableTable::byte_size(ByteSizeOption option) const
+{
+    if (frozen)
+        return sizeof(*this) + frozen_length * sizeof(KeyValue) + (sizeof(uint32_t) << index_bits);
+    return sizeof(*this) + table->byte_size(option);
+}
+
+size_t
+FreezableTable::size() const
+{
+    return frozen ? frozen_length : table->size();
+}
+
+bool
+FreezableTable::has(KeyArg key) const
+{
+    return frozen ? find_frozen(key) != NULL : table->has(key);
+}
+
+Value
+FreezableTable::get(KeyArg key) const
+{
+    if (frozen) {
+        const KeyValue *e = find_frozen(key);
+        return e ? e->value : Value();
+    }
+    return table->get(key);
+}
+
+void
+FreezableTable::set(KeyArg key, ValueArg value)
+{
+    will_write();
+    table->set(key, value);
+}
+
+bool
+FreezableTable::remove(KeyArg key)
+{
+    // Removing a key that isn't there writes nothing, so it doesn't thaw.
+    if (frozen && !find_frozen(key))
+        return false;
+    will_write();
+    return table->remove(key);
+}
+
+void
+FreezableTable::prefetch(KeyArg key) const
+{
+    if (frozen)
+        prefetch_address(&frozen_index()[index_slot(key, index_bits)]);
+    else
+        table->prefetch(key);
+}
+
+size_t
+FreezableTable::keys(Key *out) const
+{
+    if (!frozen)
+        return table->keys(out);
+    for (size_t i = 0; i < frozen_length; i++)
+        out[i] = frozen_entries()[i].key;
+    return frozen_length;
+}
+
+size_t
+FreezableTable::values(Value *out) const
+{
+    if (!frozen)
+        return table->values(out);
+    for (size_t i = 0; i < frozen_length; i++)
+        out[i] = frozen_entries()[i].value;
+    return frozen_length;
+}
+
+size_t
+FreezableTable::entries(KeyValue *out) const
+{
+    if (!frozen)
+        return table->entries(out);
+    memcpy(out, frozen_entries(), frozen_length * sizeof(KeyValue));
+    return frozen_length;
+}
+
+
+// === DirectTable
+
+DirectTable::DirectTable()
+  : slot_values(NULL), present(NULL), slots(0), live_count(0), high(0), table(NULL)
+{
+    reset();
+}
+
+DirectTable::~DirectTable()
+{
+    if (table) {
+        delete table;
+    } else {
+        delete_array(slot_values, slots);
+        delete_array(present, slots / 64);
+    }
+}
+
+// Go back to an empty array of MinSlots.
+void
+DirectTable::reset()
+{
+    if (slot_values) {
+        delete_array(slot_values, slots);
+        delete_array(present, slots / 64);
+    }
+    slots = MinSlots;
+    slot_values = new_zeroed_array<Value>(slots);
+    present = new_zeroed_array<uint64_t>(slots / 64);
+    live_count = 0;
+    high = 0;
+}
+
+void
+DirectTable::grow(size_t new_slots)
+{
+    Value *new_values = new_zeroed_array<Value>(new_slots);
+    uint64_t *new_present = new_zeroed_array<uint64_t>(new_slots / 64);
+    memcpy(new_values, slot_values, slots * sizeof(Value));
+    memcpy(new_present, present, slots / 64 * sizeof(uint64_t));
+    delete_array(slot_values, slots);
+    delete_array(present, slots / 64);
+    slot_values = new_values;
+    present = new_present;
+    slots = new_slots;
+}
+
+// Keys were added in increasing order, so key order is insertion order.
+void
+DirectTable::migrate()
+{
+    CloseTable *t = new CloseTable;
+    for (size_t w = 0; w < slots / 64; w++) {
+        for (uint64_t bits = present[w]; bits != 0; bits &= bits - 1) {
+            size_t k = w * 64 + lowest_bit64(bits);
+            t->set(Key(k), slot_values[k]);
+        }
+    }
+    delete_array(slot_values, slots);
+    delete_array(present, slots / 64);
+    slot_values = NULL;
+    present = NULL;
+    slots = 0;
+    table = t;
+}
+
+size_t
+DirectTable::byte_size(ByteSizeOption option) const
+{
+    if (table)
+        return sizeof(*this) + table->byte_size(option);
+    return sizeof(*this) + slots * sizeof(Value) + slots / 8;
+}
+
+size_t
+DirectTable::size() const
+{
+    return table ? table->size() : live_count;
+}
+
+bool
+DirectTable::has(KeyArg key) const
+{
+    if (table)
+        return table->has(key);
+    return key < slots && is_present(key);
+}
+
+Value
+DirectTable::get(KeyArg key) const
+{
+    if (table)
+        return table->get(key);
+    return key < slots ? slot_values[key] : Value();
+}
+
+void
+DirectTable::set(KeyArg key, ValueArg value)
+{
+    if (!table) {
+        if (key < slots && is_present(key)) {
+            slot_values[key] = value;
+            return;
+        }
+        if (key > high || live_count == 0) {
+            if (key < slots) {
+                present[key >> 6] |= uint64_t(1) << (key & 63);
+                slot_values[key] = value;
+                live_count++;
+                high = key;
+                return;
+            }
+            if (key <= Key(SIZE_MAX >> 2)) {
+                size_t new_slots = slots;
+                while (new_slots <= key)
+                    new_slots *= 2;
+                if (dense_enough(live_count + 1, new_slots)) {
+                    grow(new_slots);
+                    present[key >> 6] |= uint64_t(1) << (key & 63);
+                    slot_values[key] = value;
+                    live_count++;
+                    high = key;
+                    return;
+                }
+            }
+        }
+        migrate();
+    }
+    table->set(key, value);
+}
+
+bool
+DirectTable::remove(KeyArg key)
+{
+    if (table)
+        return table->remove(key);
+    if (key >= slots || !is_present(key))
+        return false;
+    present[key >> 6] &= ~(uint64_t(1) << (key & 63));
+    slot_values[key] = Value();
+    live_count--;
+    if (live_count == 0)
+        reset();
+    else if (!dense_enough(live_count, slots))
+        migrate();
+    return true;
+}
+
+void
+DirectTable::prefetch(KeyArg key) const
+{
+    if (table)
+        table->prefetch(key);
+    else if (key < slots)
+        prefetch_address(&slot_values[key]);
+}
+
+size_t
+DirectTable::keys(Key *out) const
+{
+    if (table)
+        return table->keys(out);
+    size_t j = 0;
+    for (size_t w = 0; w < slots / 64; w++) {
+        for (uint64_t bits = present[w]; bits != 0; bits &= bits - 1)
+            out[j++] = Key(w * 64 + lowest_bit64(bits));
+    }
+    return j;
+}
+
+size_t
+DirectTable::values(Value *out) const
+{
+    if (table)
+        return table->values(out);
+    size_t j = 0;
+    for (size_t w = 0; w < slots / 64; w++) {
+        for (uint64_t bits = present[w]; bits != 0; bits &= bits - 1)
+            out[j++] = slot_values[w * 64 + lowest_bit64(bits)];
+    }
+    return j;
+}
+
+size_t
+DirectTable::entries(KeyValue *out) const
+{
+    if (table)
+        return table->entries(out);
+    size_t j = 0;
+    for (size_t w = 0; w < slots / 64; w++) {
+        for (uint64_t bits = present[w]; bits != 0; bits &= bits - 1) {
+            size_t k = w * 64 + lowest_bit64(bits);
+            KeyValue kv = { Key(k), slot_values[k] };
+            out[j++] = kv;
+        }
+    }
+    return j;
+}
+
+
+// === PackedCloseTable
+
+// Allocate a block with the given number of buckets, all empty.
+PackedCloseTable::EntryPtr *
+PackedCloseTable::new_block(size_t buckets)
+{
+    EntryPtr *block = (EntryPtr *) new_array<uint64_t>(block_words(buckets));
+    memset(block, 0, buckets * sizeof(EntryPtr));
+    return block;
+}
+
+void
+PackedCloseTable::delete_block(EntryPtr *block, size_t buckets)
+{
+    delete_array((uint64_t *) block, block_words(buckets));
+}
+
+PackedCloseTable::PackedCloseTable()
+{
+    size_t buckets = initial_buckets();
+    table = new_block(buckets);
+    data = (Entry *) (table + buckets);
+    table_mask = buckets - 1;
+    entries_capacity = capacity_for(buckets);
+    entries_length = 0;
     live_count = 0;
-    nonempty_count = 0;
 }
 
-OpenTable::~OpenTable() {
-    delete[] table;
+PackedCloseTable::~PackedCloseTable()
+{
+    delete_block(table, table_mask + 1);
+}
+
+PackedCloseTable::Entry *
+PackedCloseTable::lookup(KeyArg key, hashcode_t h) const
+{
+    Entry *e;
+    for (e = table[h & table_mask]; e; e = e->chain) {
+        if (e->key == key)
+            break;
+    }
+    return e;
+}
+
+void
+PackedCloseTable::rehash(size_t new_table_mask)
+{
+    size_t new_buckets = new_table_mask + 1;
+    size_t new_capacity = capacity_for(new_buckets);
+    if (new_capacity > SIZE_MAX / sizeof(Entry))
+        abort();
+    EntryPtr *new_table = new_block(new_buckets);
+    Entry *new_entries = (Entry *) (new_table + new_buckets);
+
+    Entry *q = new_entries;
+    for (Entry *p = data, *end = data + entries_length; p != end; p++) {
+        if (!isEmpty(p->key)) {
+            hashcode_t h = hash(p->key) & new_table_mask;
+            q->key = p->key;
+            q->value = p->value;
+            q->chain = new_table[h];
+            new_table[h] = q;
+            q++;
+        }
+    }
+
+    delete_block(table, table_mask + 1);
+    table = new_table;
+    data = new_entries;
+    table_mask = new_table_mask;
+    entries_capacity = new_capacity;
+    entries_length = live_count;
+}
+
+size_t
+PackedCloseTable::byte_size(ByteSizeOption option) const
+{
+    return sizeof(*this)
+        + (table_mask + 1) * sizeof(EntryPtr)
+        + (option == BytesAllocated ? entries_capacity : entries_length) * sizeof(Entry);
+}
+
+size_t
+PackedCloseTable::size() const
+{
+    return live_count;
+}
+
+bool
+PackedCloseTable::has(KeyArg key) const
+{
+    return lookup(key, hash(key)) != NULL;
+}
+
+Value
+PackedCloseTable::get(KeyArg key) const
+{
+    const Entry *e = lookup(key, hash(key));
+    return e ? e->value : Value();
+}
+
+void
+PackedCloseTable::set(KeyArg key, ValueArg value)
+{
+    hashcode_t h = hash(key);
+    Entry *e = lookup(key, h);
+    if (e) {
+        e->value = value;
+        return;
+    }
+    if (entries_length == entries_capacity) {
+        // As for CloseTable: compact if at least 1/4 of the entries are
+        // removed ones, otherwise grow.
+        rehash(live_count >= entries_capacity - entries_capacity / 4
+               ? double_capacity(table_mask + 1, sizeof(EntryPtr)) - 1
+               : table_mask);
+    }
+    h &= table_mask;
+    live_count++;
+    e = &data[entries_length++];
+    e->key = key;
+    e->value = value;
+    e->chain = table[h];
+    table[h] = e;
+}
+
+bool
+PackedCloseTable::remove(KeyArg key)
+{
+    Entry *e = lookup(key, hash(key));
+    if (e == NULL)
+        return false;
+    live_count--;
+    makeEmpty(e->key);
+    if (table_mask > initial_buckets() && live_count < min_vector_fill(entries_length))
+        rehash(table_mask >> 1);
+    return true;
+}
+
+void
+PackedCloseTable::prefetch(KeyArg key) const
+{
+    const EntryPtr *bucket = &table[hash(key) & table_mask];
+    prefetch_address(bucket);
+    if (const Entry *e = *bucket)
+        prefetch_address(e);
+}
+
+size_t
+PackedCloseTable::keys(Key *out) const
+{
+    return export_live<ExportKeys>(data, entries_length, out, live_count);
+}
+
+size_t
+PackedCloseTable::values(Value *out) const
+{
+    return export_live<ExportValues>(data, entries_length, out, live_count);
+}
+
+size_t
+PackedCloseTable::entries(KeyValue *out) const
+{
+    return export_live<ExportEntries>(data, entries_length, out, live_count);
+}
+
+
+// === MemoryBudget
+
+BudgetedTableBase::BudgetedTableBase(MemoryBudget *budget)
+  : budget(budget), next(budget->tables), prevp(&budget->tables), counted_bytes(0)
+{
+    if (next)
+        next->prevp = &next;
+    budget->tables = this;
+}
+
+BudgetedTableBase::~BudgetedTableBase()
+{
+    *prevp = next;
+    if (next)
+        next->prevp = prevp;
+}
+
+void
+BudgetedTableBase::size_changed(size_t bytes)
+{
+    bool grew = bytes > counted_bytes;
+    budget->total += bytes - counted_bytes;
+    counted_bytes = bytes;
+    if (grew && budget->total > budget->limit && budget->total > budget->quiet_until
+        && !budget->reclaiming)
+        budget->reclaim(this);
+}
+
+MemoryBudget::MemoryBudget(size_t limit_bytes)
+  : tables(NULL), limit(limit_bytes), total(0), quiet_until(0), reclaiming(false),
+    passes(0), reclaimed(0)
+{
+}
+
+MemoryBudget::~MemoryBudget()
+{
+    // The tables must go first.
+    if (tables)
+        abort();
+}
+
+void
+MemoryBudget::set_limit_bytes(size_t limit_bytes)
+{
+    limit = limit_bytes;
+    quiet_until = 0;
+    if (total > limit)
+        reclaim(NULL);
+}
+
+struct SlackRecord {
+    size_t slack;
+    BudgetedTableBase *table;
+};
+
+// Restore the max-heap property of heap[0..n) below i.
+static void
+sift_down(SlackRecord *heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t biggest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && heap[l].slack > heap[biggest].slack)
+            biggest = l;
+        if (r < n && heap[r].slack > heap[biggest].slack)
+            biggest = r;
+        if (biggest == i)
+            return;
+        SlackRecord tmp = heap[i];
+        heap[i] = heap[biggest];
+        heap[biggest] = tmp;
+        i = biggest;
+    }
 }
 
-OpenTable::Entry *
-OpenTable::lookup(KeyArg key)
+size_t
+MemoryBudget::reclaim(BudgetedTableBase *except)
 {
-    hashcode_t h = hash(key);
-    size_t i = h & mask;
-    h >>= 3;
-    while (!isEmpty(table[i].key)) {
-        if (table[i].key == key)
-            return &table[i];
-        i = (i + (h | 1)) & mask;
+    size_t n = 0;
+    for (BudgetedTableBase *t = tables; t; t = t->next)
+        n++;
+    SlackRecord *heap = new SlackRecord[n + 1];
+    n = 0;
+    for (BudgetedTableBase *t = tables; t; t = t->next) {
+        if (t != except) {
+            size_t slack = t->slack_bytes();
+            if (slack > 0) {
+                heap[n].slack = slack;
+                heap[n].table = t;
+                n++;
+            }
+        }
     }
-    return NULL;
+    for (size_t i = n / 2; i-- > 0; )
+        sift_down(heap, n, i);
+
+    // Compacting a table changes its size, which calls size_changed, which
+    // must not start another pass.
+    reclaiming = true;
+    size_t before = total;
+    while (n > 0 && total > limit) {
+        heap[0].table->compact();
+        heap[0] = heap[--n];
+        sift_down(heap, n, 0);
+    }
+    reclaiming = false;
+    delete[] heap;
+
+    size_t freed = before > total ? before - total : 0;
+    passes++;
+    reclaimed += freed;
+    quiet_until = total > limit ? total + limit / 16 : 0;
+    return freed;
+}
+
+
+// === MmapTable
+
+#ifdef HAVE_MMAP
+
+MmapTable::MmapTable(const char *dir)
+  : dir(dir), live_count(0), max_overflow(0)
+{
+    typedef char page_fits_in_PageSize[sizeof(Page) <= PageSize ? 1 : -1];
+    (void) sizeof(page_fits_in_PageSize);
+    map_pages(1);
 }
 
-const OpenTable::Entry *
-OpenTable::lookup(KeyArg key) const
+MmapTable::~MmapTable()
 {
-    return const_cast<OpenTable *>(this)->lookup(key);
+    unmap_pages();
 }
 
+// Create a new backing file of the given number of pages and map it. The
+// file is unlinked right away, so it goes away when it is unmapped and
+// closed, even if we crash.
 void
-OpenTable::rehash(size_t new_capacity)
+MmapTable::map_pages(size_t count)
 {
-    Entry *old_table = table;
-    Entry *old_table_end = table + mask + 1;
-    table = new Entry[new_capacity];
-    mask = new_capacity - 1;
-    live_count = 0;
-    nonempty_count = 0;
-    for (Entry *p = old_table; p != old_table_end; ++p) {
-        if (isLive(p->key))
-            set(p->key, p->value);
-    }
-    delete[] old_table;
+    const char *d = dir;
+    if (!d)
+        d = getenv("TMPDIR");
+    if (!d || !*d)
+        d = "/tmp";
+    size_t len = strlen(d);
+    char *path = new char[len + sizeof("/mmaptable-XXXXXX")];
+    memcpy(path, d, len);
+    strcpy(path + len, "/mmaptable-XXXXXX");
+    fd = mkstemp(path);
+    if (fd < 0)
+        abort();
+    unlink(path);
+    delete[] path;
+
+    if (count > SIZE_MAX / PageSize || ftruncate(fd, off_t(count * PageSize)) != 0)
+        abort();
+    void *p = mmap(NULL, count * PageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        abort();
+
+    // The file starts out zero-filled, which is an empty page.
+    base = (char *) p;
+    page_mask = count - 1;
+    page_bits = 0;
+    while ((size_t(1) << page_bits) < count)
+        page_bits++;
 }
 
-size_t
-OpenTable::byte_size(ByteSizeOption) const
+void
+MmapTable::unmap_pages()
 {
-    return sizeof(*this) + (mask + 1) * sizeof(Entry);
+    munmap(base, (page_mask + 1) * PageSize);
+    close(fd);
 }
 
-size_t
-OpenTable::size() const
+MmapTable::Entry *
+MmapTable::lookup_in_page(Page *page, KeyArg key, size_t bucket)
 {
-    return live_count;
+    for (unsigned i = page->buckets[bucket]; i; i = page->chain[i - 1]) {
+        if (page->entries[i - 1].key == key)
+            return &page->entries[i - 1];
+    }
+    return NULL;
 }
 
-bool
-OpenTable::has(KeyArg key) const
+MmapTable::Entry *
+MmapTable::lookup(KeyArg key) const
 {
-    return lookup(key) != NULL;
+    hashcode_t h = hash(key);
+    size_t bucket = (h >> page_bits) & (BucketsPerPage - 1);
+    size_t i = h & page_mask;
+    for (size_t distance = 0; ; distance++) {
+        Page *p = page(i);
+        Entry *e = lookup_in_page(p, key, bucket);
+        if (e || !p->overflowed || distance == max_overflow)
+            return e;
+        i = (i + 1) & page_mask;
+    }
 }
 
-Value
-OpenTable::get(KeyArg key) const
+// Squeeze the empty entries out of a page, preserving the order of the rest.
+// This leaves p->overflowed alone: entries that spilled past this page stay
+// where they are until the next rehash, which starts with fresh pages.
+void
+MmapTable::compact_page(Page *p)
 {
-    const Entry *e = lookup(key);
-    return e ? e->value : Value();
+    memset(p->buckets, 0, sizeof(p->buckets));
+    unsigned n = 0;
+    for (unsigned i = 0; i < p->length; i++) {
+        Entry e = p->entries[i];
+        if (isEmpty(e.key))
+            continue;
+        size_t bucket = (hash(e.key) >> page_bits) & (BucketsPerPage - 1);
+        p->entries[n] = e;
+        p->chain[n] = p->buckets[bucket];
+        p->buckets[bucket] = n + 1;
+        n++;
+    }
+    p->length = n;
 }
 
 void
-OpenTable::set(KeyArg key, ValueArg value)
+MmapTable::insert(KeyArg key, ValueArg value)
 {
     hashcode_t h = hash(key);
-    size_t i = h & mask;
-    h >>= 3;
-    while (isLive(table[i].key)) {
-        if (table[i].key == key) {
-            table[i].value = value;
+    size_t bucket = (h >> page_bits) & (BucketsPerPage - 1);
+    size_t i = h & page_mask;
+    for (size_t distance = 0; ; distance++) {
+        Page *p = page(i);
+        if (p->length == EntriesPerPage && p->live < EntriesPerPage)
+            compact_page(p);
+        if (p->length < EntriesPerPage) {
+            unsigned n = p->length++;
+            p->live++;
+            p->entries[n].key = key;
+            p->entries[n].value = value;
+            p->chain[n] = p->buckets[bucket];
+            p->buckets[bucket] = n + 1;
+            live_count++;
+            if (distance > max_overflow)
+                max_overflow = distance;
             return;
         }
-        i = (i + (h | 1)) & mask;
+        p->overflowed = 1;
+        i = (i + 1) & page_mask;
     }
-
-    bool tomb = isTombstone(table[i].key);
-    table[i].key = key;
-    table[i].value = value;
-    live_count++;
-    if (!tomb)
-        nonempty_count++;
-    if (nonempty_count > (mask + 1) * max_fill_ratio())
-        rehash((mask + 1) << 1);
 }
 
-bool
-OpenTable::remove(KeyArg key)
+void
+MmapTable::rehash(size_t new_page_count)
 {
-    Entry *e = lookup(key);
-    if (!e)
-        return false;
-    makeTombstone(e->key);
-    live_count--;
-    if (mask > 7 && live_count < (mask + 1) * min_fill_ratio())
-        rehash((mask + 1) >> 1);
-    return true;
-}
-
+    char *old_base = base;
+    int old_fd = fd;
+    size_t old_page_count = page_mask + 1;
 
-// === DenseTable
-
-#ifdef HAVE_SPARSEHASH
+    map_pages(new_page_count);
+    live_count = 0;
+    max_overflow = 0;
+    for (size_t i = 0; i < old_page_count; i++) {
+        Page *p = (Page *) (old_base + i * PageSize);
+        for (unsigned j = 0; j < p->length; j++) {
+            if (!isEmpty(p->entries[j].key))
+                insert(p->entries[j].key, p->entries[j].value);
+        }
+    }
 
-DenseTable::DenseTable()
-{
-    Key k;
-    makeEmpty(k);
-    map.set_empty_key(k);
-    makeTombstone(k);
-    map.set_deleted_key(k);
+    munmap(old_base, old_page_count * PageSize);
+    close(old_fd);
 }
 
 size_t
-DenseTable::byte_size(ByteSizeOption) const
+MmapTable::byte_size(ByteSizeOption) const
 {
-    return sizeof(*this) + sizeof(std::pair<const Key, Value>) * map.bucket_count();
+    return sizeof(*this) + (page_mask + 1) * PageSize;
 }
 
 size_t
-DenseTable::size() const
+MmapTable::size() const
 {
-    return map.size();
+    return live_count;
 }
 
 bool
-DenseTable::has(KeyArg key) const
+MmapTable::has(KeyArg key) const
 {
-    return map.find(key) != map.end();
+    return lookup(key) != NULL;
 }
 
 Value
-DenseTable::get(KeyArg key) const
+MmapTable::get(KeyArg key) const
 {
-    Map::const_iterator it = map.find(key);
-    return (it == map.end() ? Value() : it->second);
+    const Entry *e = lookup(key);
+    return e ? e->value : Value();
 }
 
 void
-DenseTable::set(KeyArg key, ValueArg value)
+MmapTable::set(KeyArg key, ValueArg value)
 {
-    map[key] = value;
+    Entry *e = lookup(key);
+    if (e) {
+        e->value = value;
+        return;
+    }
+    if (live_count >= max_fill(page_mask + 1))
+        rehash((page_mask + 1) * 2);
+    insert(key, value);
 }
 
 bool
-DenseTable::remove(KeyArg key)
+MmapTable::remove(KeyArg key)
 {
-    Map::iterator it = map.find(key);
-    if (it == map.end())
+    Entry *e = lookup(key);
+    if (!e)
         return false;
-    map.erase(it);
-    size_t n = map.bucket_count();
-    if (n > 32 && map.size() <= n / 8)
-        map.resize(0);
+    makeEmpty(e->key);
+    page(size_t((char *) e - base) / PageSize)->live--;
+    live_count--;
+
+    if (page_mask > 0 && live_count < min_fill(page_mask + 1))
+        rehash((page_mask + 1) / 2);
     return true;
 }
 
-#endif  // HAVE_SPARSEHASH
+// Unlike CloseTable::prefetch, this doesn't read the bucket to find the first
+// entry, since reading it could fault the page in from the file and block.
+// A prefetch of a page that isn't resident just does nothing.
+void
+MmapTable::prefetch(KeyArg key) const
+{
+    hashcode_t h = hash(key);
+    const Page *p = page(h & page_mask);
+    prefetch_address(&p->buckets[(h >> page_bits) & (BucketsPerPage - 1)]);
+}
+
+// Unmapping the pages alone would leave them in the page cache, so that the
+// next access is only a minor fault. Write back any dirty pages first, then
+// ask the kernel to drop the file's cached pages too. (posix_fadvise can't
+// drop the pages of a file on tmpfs, which has no backing store.)
+void
+MmapTable::release_resident()
+{
+    size_t len = (page_mask + 1) * PageSize;
+    msync(base, len, MS_SYNC);
+    madvise(base, len, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, off_t(len), POSIX_FADV_DONTNEED);
+#endif
+}
+
+#endif  // HAVE_MMAP
+
 
 
-// === CloseTable
+// === VersionedCloseTable
 
-CloseTable::CloseTable()
+#ifdef HAVE_PTHREADS
+
+// Fields marked "atomic" in the class are only accessed through these, except
+// by the owner thread reading fields that only it writes.
+#define ATOMIC_LOAD(p, order) __atomic_load_n(p, __ATOMIC_##order)
+#define ATOMIC_STORE(p, v, order) __atomic_store_n(p, v, __ATOMIC_##order)
+
+VersionedCloseTable::VersionedCloseTable()
 {
     size_t buckets = initial_buckets();
-    table = new EntryPtr[buckets];
-    memset(table, 0, buckets * sizeof(EntryPtr));
+    table = new_zeroed_array<EntryPtr>(buckets);
     table_mask = buckets - 1;
-    entries_capacity = size_t(buckets * fill_factor());
-    entries = new Entry[entries_capacity];
-    entries_length = 0;
+    store = new_store(capacity_for(buckets));
     live_count = 0;
+    epoch = 0;
+    for (size_t i = 0; i < MaxReaders; i++)
+        readers[i].store = NULL;
 }
 
-CloseTable::~CloseTable()
+VersionedCloseTable::~VersionedCloseTable()
 {
-    delete[] table;
-    delete[] entries;
+    delete_array(table, table_mask + 1);
+    free(store);
 }
 
-CloseTable::Entry *
-CloseTable::lookup(KeyArg key, hashcode_t h)
+VersionedCloseTable::Store *
+VersionedCloseTable::new_store(size_t capacity)
 {
-    for (Entry *e = table[h & table_mask]; e; e = e->chain) {
-        if (e->key == key)
+    if (capacity > (SIZE_MAX - sizeof(Store)) / sizeof(Entry))
+        abort();
+    Store *s = (Store *) malloc(sizeof(Store) + (capacity - 1) * sizeof(Entry));
+    if (!s)
+        abort();
+    s->capacity = capacity;
+    s->length = 0;
+    return s;
+}
+
+VersionedCloseTable::Entry *
+VersionedCloseTable::lookup(KeyArg key) const
+{
+    for (Entry *e = table[hash(key) & table_mask]; e; e = e->chain) {
+        if (e->key == key && e->died == forever())
             return e;
     }
     return NULL;
 }
 
-const CloseTable::Entry *
-CloseTable::lookup(KeyArg key) const {
-    return const_cast<CloseTable *>(this)->lookup(key, hash(key));
+// Add an entry and make it visible to new Snapshots. The caller must make
+// sure there is room.
+void
+VersionedCloseTable::append(KeyArg key, ValueArg value, Epoch born)
+{
+    size_t n = store->length;
+    Entry *e = &store->entries[n];
+    e->key = key;
+    e->value = value;
+    e->born = born;
+    e->died = forever();
+    hashcode_t h = hash(key) & table_mask;
+    e->chain = table[h];
+    table[h] = e;
+    ATOMIC_STORE(&store->length, n + 1, RELEASE);
 }
 
 void
-CloseTable::rehash(size_t new_table_mask)
+VersionedCloseTable::rehash(size_t new_table_mask)
 {
-    size_t new_capacity = size_t((new_table_mask + 1) * fill_factor());
-    EntryPtr *new_table = new EntryPtr[new_table_mask + 1];
-    memset(new_table, 0, (new_table_mask + 1) * sizeof(EntryPtr));
-    Entry *new_entries = new Entry[new_capacity];
+    Store *old_store = store;
+    Store *new_s = new_store(capacity_for(new_table_mask + 1));
+    delete_array(table, table_mask + 1);
+    table = new_zeroed_array<EntryPtr>(new_table_mask + 1);
+    table_mask = new_table_mask;
 
-    Entry *q = new_entries;
-    for (Entry *p = entries, *end = entries + entries_length; p != end; p++) {
-        if (!isEmpty(p->key)) {
+    // Copy the live entries, keeping their birth epochs. Readers of the new
+    // store will all have epochs at least as new as the current one, so the
+    // dead entries are of no use to them. Nobody else can see the new store
+    // yet, so there's no need to be careful about the order of writes.
+    Entry *q = new_s->entries;
+    for (Entry *p = old_store->entries, *end = p + old_store->length; p != end; p++) {
+        if (p->died == forever()) {
             hashcode_t h = hash(p->key) & new_table_mask;
-            q->key = p->key;
-            q->value = p->value;
-            q->chain = new_table[h];
-            new_table[h] = q;
+            *q = *p;
+            q->chain = table[h];
+            table[h] = q;
             q++;
         }
     }
+    new_s->length = q - new_s->entries;
 
-    delete[] table;
-    delete[] entries;
-    table = new_table;
-    table_mask = new_table_mask;
-    entries = new_entries;
-    entries_capacity = new_capacity;
-    entries_length = live_count;
+    // Publish the new store, then wait for every Snapshot still reading the
+    // old one to go away.
+    ATOMIC_STORE(&store, new_s, SEQ_CST);
+    for (size_t i = 0; i < MaxReaders; i++) {
+        while (ATOMIC_LOAD(&readers[i].store, SEQ_CST) == old_store)
+            sched_yield();
+    }
+    free(old_store);
 }
 
 size_t
-CloseTable::byte_size(ByteSizeOption option) const
+VersionedCloseTable::byte_size(ByteSizeOption option) const
 {
     return sizeof(*this)
         + (table_mask + 1) * sizeof(EntryPtr)
-        + (option == BytesAllocated ? entries_capacity : entries_length) * sizeof(Entry);
+        + sizeof(Store) - sizeof(Entry)
+        + (option == BytesAllocated ? store->capacity : store->length) * sizeof(Entry);
 }
 
 size_t
-CloseTable::size() const
+VersionedCloseTable::size() const
 {
     return live_count;
 }
 
 bool
-CloseTable::has(KeyArg key) const
+VersionedCloseTable::has(KeyArg key) const
 {
     return lookup(key) != NULL;
 }
 
 Value
-CloseTable::get(KeyArg key) const
+VersionedCloseTable::get(KeyArg key) const
 {
     const Entry *e = lookup(key);
     return e ? e->value : Value();
 }
 
 void
-CloseTable::set(KeyArg key, ValueArg value)
+VersionedCloseTable::set(KeyArg key, ValueArg value)
 {
-    hashcode_t h = hash(key);
-    Entry *e = lookup(key, h);
-    if (e) {
-        e->value = value;
-    } else {
-        if (entries_length == entries_capacity) {
-            // If the table is more than 1/4 deleted entries, simply rehash in
-            // place to free up some space. Otherwise, grow the table.
-            rehash(live_count >= entries_capacity * 0.75
-                   ? (table_mask << 1) | 1
-                   : table_mask);
-        }
-        h &= table_mask;
-        live_count++;
-        e = &entries[entries_length++];
-        e->key = key;
-        e->value = value;
-        e->chain = table[h];
-        table[h] = e;
+    Entry *e = lookup(key);
+    if (e && e->value == value)
+        return;
+
+    // Either way we append an entry, so first make room.
+    if (store->length == store->capacity) {
+        rehash(live_count >= store->capacity - store->capacity / 4
+               ? (table_mask << 1) | 1
+               : table_mask);
+        e = lookup(key);
     }
+
+    Epoch now = epoch + 1;
+    if (e)
+        ATOMIC_STORE(&e->died, now, RELAXED);
+    else
+        live_count++;
+    append(key, value, now);
+    ATOMIC_STORE(&epoch, now, RELEASE);
 }
 
 bool
-CloseTable::remove(KeyArg key)
+VersionedCloseTable::remove(KeyArg key)
 {
-    // If an entry exists for the given key, empty it.
-    Entry *e = lookup(key, hash(key));
-    if (e == NULL)
+    Entry *e = lookup(key);
+    if (!e)
         return false;
+    Epoch now = epoch + 1;
+    ATOMIC_STORE(&e->died, now, RELAXED);
     live_count--;
-    makeEmpty(e->key);
+    ATOMIC_STORE(&epoch, now, RELEASE);
 
-    // If many entries have been removed, shrink the table.
-    if (table_mask > initial_buckets() && live_count < entries_length * min_vector_fill())
+    if (table_mask > initial_buckets() && live_count < store->length / 4)
         rehash(table_mask >> 1);
     return true;
 }
+
+void
+VersionedCloseTable::prefetch(KeyArg key) const
+{
+    Entry *const *bucket = &table[hash(key) & table_mask];
+    prefetch_address(bucket);
+    if (const Entry *e = *bucket)
+        prefetch_address(e);
+}
+
+VersionedCloseTable::Snapshot::Snapshot(VersionedCloseTable &table)
+  : slot(NULL), i(0)
+{
+    // Claim a free reader slot.
+    for (;;) {
+        for (size_t k = 0; k < MaxReaders && !slot; k++) {
+            Store *expected = NULL;
+            Store *current = ATOMIC_LOAD(&table.store, SEQ_CST);
+            if (__atomic_compare_exchange_n(&table.readers[k].store, &expected, current,
+                                            false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                slot = &table.readers[k];
+        }
+        if (slot)
+            break;
+        sched_yield();
+    }
+
+    // The slot says which store we intend to read. If the owner replaced that
+    // store before we read the epoch, it may already have freed it, or the
+    // store may lack entries from epochs we would consider visible, so try
+    // again with the new store. Otherwise the owner can't free it until we
+    // clear the slot.
+    Store *s;
+    for (;;) {
+        s = ATOMIC_LOAD(&slot->store, SEQ_CST);
+        epoch = ATOMIC_LOAD(&table.epoch, SEQ_CST);
+        Store *current = ATOMIC_LOAD(&table.store, SEQ_CST);
+        if (current == s)
+            break;
+        ATOMIC_STORE(&slot->store, current, SEQ_CST);
+    }
+
+    entries = s->entries;
+    length = ATOMIC_LOAD(&s->length, ACQUIRE);
+    seek();
+}
+
+VersionedCloseTable::Snapshot::~Snapshot()
+{
+    ATOMIC_STORE(&slot->store, (Store *) NULL, RELEASE);
+}
+
+// Skip entries not live at our epoch.
+void
+VersionedCloseTable::Snapshot::seek()
+{
+    while (i < length
+           && (entries[i].born > epoch || ATOMIC_LOAD(&entries[i].died, RELAXED) <= epoch))
+        i++;
+}
+
+
+
+// === AtomTable
+
+#define ATOMIC_CAS(p, expected, desired, order) \
+    __atomic_compare_exchange_n(p, expected, desired, false, __ATOMIC_##order, __ATOMIC_ACQUIRE)
+
+AtomTable::AtomTable()
+  : slots(new_slot_array(16)), retired(NULL), count(0)
+{
+    for (size_t i = 0; i < LockCount; i++)
+        pthread_mutex_init(&locks[i].mutex, NULL);
+}
+
+AtomTable::~AtomTable()
+{
+    for (size_t i = 0; i <= slots->mask; i++)
+        free(slots->slots[i].atom);
+    free(slots);
+    while (retired) {
+        SlotArray *next = retired->retired;
+        free(retired);
+        retired = next;
+    }
+    for (size_t i = 0; i < LockCount; i++)
+        pthread_mutex_destroy(&locks[i].mutex);
+}
+
+// FNV-1a.
+hashcode_t
+AtomTable::hash_chars(const char *chars, size_t length)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char) chars[i];
+        h *= 0x100000001b3ull;
+    }
+    return hashcode_t(h);
+}
+
+AtomTable::SlotArray *
+AtomTable::new_slot_array(size_t capacity)
+{
+    if (capacity - 1 > (SIZE_MAX - sizeof(SlotArray)) / sizeof(Slot))
+        abort();
+    SlotArray *a = (SlotArray *) calloc(1, sizeof(SlotArray) + (capacity - 1) * sizeof(Slot));
+    if (!a)
+        abort();
+    a->mask = capacity - 1;
+    return a;
+}
+
+const AtomTable::Atom *
+AtomTable::find(const SlotArray *a, const char *chars, size_t length, hashcode_t h)
+{
+    size_t i = h & a->mask;
+    hashcode_t step = (h >> 3) | 1;
+    for (;;) {
+        const Slot *s = &a->slots[i];
+        const Atom *atom = ATOMIC_LOAD(&s->atom, ACQUIRE);
+        if (!atom)
+            return NULL;
+        // The hash code may not have been written yet, in which case this
+        // is a string that is still being inserted, and we may skip it.
+        if (ATOMIC_LOAD(&s->hash, RELAXED) == h
+            && atom->length_ == length
+            && memcmp(atom->chars_, chars, length) == 0)
+            return atom;
+        i = (i + step) & a->mask;
+    }
+}
+
+// Put an atom in an empty slot. Return false if the array is full.
+bool
+AtomTable::insert(SlotArray *a, Atom *atom)
+{
+    size_t i = atom->hash & a->mask;
+    hashcode_t step = (atom->hash >> 3) | 1;
+    for (size_t probes = 0; probes <= a->mask; probes++) {
+        Slot *s = &a->slots[i];
+        Atom *expected = NULL;
+        if (ATOMIC_CAS(&s->atom, &expected, atom, RELEASE)) {
+            ATOMIC_STORE(&s->hash, atom->hash, RELAXED);
+            return true;
+        }
+        i = (i + step) & a->mask;
+    }
+    return false;
+}
+
+size_t
+AtomTable::byte_size(ByteSizeOption option) const
+{
+    const SlotArray *a = ATOMIC_LOAD(&slots, ACQUIRE);
+    size_t bytes = sizeof(*this) + sizeof(SlotArray) + a->mask * sizeof(Slot);
+    if (option == BytesAllocated) {
+        for (const SlotArray *r = retired; r; r = r->retired)
+            bytes += sizeof(SlotArray) + r->mask * sizeof(Slot);
+    }
+    for (size_t i = 0; i <= a->mask; i++) {
+        if (const Atom *atom = ATOMIC_LOAD(&a->slots[i].atom, ACQUIRE))
+            bytes += sizeof(Atom) + atom->length_;
+    }
+    return bytes;
+}
+
+size_t
+AtomTable::size() const
+{
+    return ATOMIC_LOAD(&count, RELAXED);
+}
+
+const AtomTable::Atom *
+AtomTable::lookup(const char *chars, size_t length) const
+{
+    return find(ATOMIC_LOAD(&slots, ACQUIRE), chars, length, hash_chars(chars, length));
+}
+
+const AtomTable::Atom *
+AtomTable::atomize(const char *chars, size_t length)
+{
+    hashcode_t h = hash_chars(chars, length);
+    if (const Atom *atom = find(ATOMIC_LOAD(&slots, ACQUIRE), chars, length, h))
+        return atom;
+
+    // Look again under the lock for this hash code, since another thread may
+    // have added the string in the meantime. The lock also keeps the slot
+    // array from being replaced until we're done.
+    Lock &lock = locks[(h >> 16) % LockCount];
+    for (;;) {
+        pthread_mutex_lock(&lock.mutex);
+        SlotArray *a = ATOMIC_LOAD(&slots, ACQUIRE);
+        const Atom *found = find(a, chars, length, h);
+        if (found) {
+            pthread_mutex_unlock(&lock.mutex);
+            return found;
+        }
+
+        // Reserve room before inserting, so that threads inserting under
+        // other locks can't fill the array between them. There must always
+        // be an empty slot, or find() would never stop.
+        if (__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED) <= max_fill(a->mask + 1)) {
+            if (length > SIZE_MAX - sizeof(Atom))
+                abort();
+            Atom *atom = (Atom *) malloc(sizeof(Atom) + length);
+            if (!atom)
+                abort();
+            atom->hash = h;
+            atom->length_ = length;
+            atom->marked = false;
+            memcpy(atom->chars_, chars, length);
+            atom->chars_[length] = '\0';
+            if (!insert(a, atom))
+                abort();
+            pthread_mutex_unlock(&lock.mutex);
+            return atom;
+        }
+
+        __atomic_sub_fetch(&count, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lock.mutex);
+        grow(a);
+    }
+}
+
+void
+AtomTable::grow(SlotArray *full)
+{
+    for (size_t i = 0; i < LockCount; i++)
+        pthread_mutex_lock(&locks[i].mutex);
+
+    // Another thread may have grown the array first.
+    if (ATOMIC_LOAD(&slots, RELAXED) == full) {
+        SlotArray *a = new_slot_array(double_capacity(full->mask + 1, sizeof(Slot)));
+        for (size_t i = 0; i <= full->mask; i++) {
+            if (Atom *atom = full->slots[i].atom)
+                insert(a, atom);
+        }
+        ATOMIC_STORE(&slots, a, RELEASE);
+        full->retired = retired;
+        retired = full;
+    }
+
+    for (size_t i = LockCount; i > 0; i--)
+        pthread_mutex_unlock(&locks[i - 1].mutex);
+}
+
+void
+AtomTable::mark(const Atom *atom)
+{
+    const_cast<Atom *>(atom)->marked = true;
+}
+
+void
+AtomTable::sweep()
+{
+    while (retired) {
+        SlotArray *next = retired->retired;
+        free(retired);
+        retired = next;
+    }
+
+    // Free the unmarked atoms, and rebuild the slot array around the rest,
+    // at most half full, so that it has room to grow again.
+    SlotArray *old = slots;
+    size_t live = 0;
+    for (size_t i = 0; i <= old->mask; i++) {
+        Atom *atom = old->slots[i].atom;
+        if (atom && !atom->marked) {
+            free(atom);
+            old->slots[i].atom = NULL;
+        } else if (atom) {
+            live++;
+        }
+    }
+    size_t capacity = 16;
+    while (capacity / 2 < live)
+        capacity = double_capacity(capacity, sizeof(Slot));
+    SlotArray *a = new_slot_array(capacity);
+    for (size_t i = 0; i <= old->mask; i++) {
+        if (Atom *atom = old->slots[i].atom) {
+            atom->marked = false;
+            insert(a, atom);
+        }
+    }
+    free(old);
+    slots = a;
+    count = live;
+}
+
+#undef ATOMIC_LOAD
+#undef ATOMIC_STORE
+#undef ATOMIC_CAS
+
+#endif  // HAVE_PTHREADS
+
+
+#ifdef HAVE_PTHREADS
+// === Parallel scans
+
+#define ATOMIC_LOAD(p, order) __atomic_load_n(p, __ATOMIC_##order)
+#define ATOMIC_STORE(p, v, order) __atomic_store_n(p, v, __ATOMIC_##order)
+#define ATOMIC_CAS(p, expected, desired) \
+    __atomic_compare_exchange_n(p, expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+// A thread's share of the chunks, [front, back), packed into one word, so
+// that the owner taking from the front and a thief taking from the back
+// can't both get the same chunk. The packed range is all there is to a
+// share, so a compare-and-swap that finds the value it expected finds the
+// share in exactly the state the new value was computed from, even if the
+// share changed and changed back in between, and the update is correct.
+struct ChunkShare {
+    uint64_t range;     // atomic; front in the low 32 bits, back in the high 32
+    char padding[64 - sizeof(uint64_t)];
+};
+
+static inline uint64_t
+pack_share(uint64_t front, uint64_t back)
+{
+    return front | back << 32;
+}
+
+struct ChunkScan {
+    ChunkBody *body;
+    ChunkShare *shares;
+    int threads;
+    size_t length;
+    size_t chunk_size;
+};
+
+struct ChunkWorker {
+    ChunkScan *scan;
+    int index;
+    pthread_t thread;
+};
+
+// Take the chunk at the front of a share. Return false if it is empty.
+static bool
+take_front(ChunkShare &share, size_t &chunk)
+{
+    uint64_t r = ATOMIC_LOAD(&share.range, ACQUIRE);
+    for (;;) {
+        uint64_t front = r & 0xffffffff, back = r >> 32;
+        if (front >= back)
+            return false;
+        if (ATOMIC_CAS(&share.range, &r, pack_share(front + 1, back))) {
+            chunk = size_t(front);
+            return true;
+        }
+    }
+}
+
+// Move the back half of victim's share (rounded up) to thief's, which must
+// be empty, and so is left alone by other threads. Return false if victim's
+// share is empty.
+static bool
+steal_half(ChunkShare &victim, ChunkShare &thief)
+{
+    uint64_t r = ATOMIC_LOAD(&victim.range, ACQUIRE);
+    for (;;) {
+        uint64_t front = r & 0xffffffff, back = r >> 32;
+        if (front >= back)
+            return false;
+        uint64_t mid = back - (back - front + 1) / 2;
+        if (ATOMIC_CAS(&victim.range, &r, pack_share(front, mid))) {
+            ATOMIC_STORE(&thief.range, pack_share(mid, back), RELEASE);
+            return true;
+        }
+    }
+}
+
+// Run chunks until every share looks empty. A chunk can be in flight,
+// stolen but not yet in its thief's share, when another thread gives up;
+// that's fine, since the thief will run it.
+static void
+run_chunks(ChunkScan &scan, int index)
+{
+    ChunkShare &own = scan.shares[index];
+    for (;;) {
+        size_t chunk;
+        while (take_front(own, chunk)) {
+            size_t begin = chunk * scan.chunk_size;
+            size_t end = scan.length - begin < scan.chunk_size ? scan.length : begin + scan.chunk_size;
+            scan.body->run(index, chunk, begin, end);
+        }
+
+        // Try the other threads in turn, starting with the next one, so
+        // that thieves spread out over their victims.
+        int i = 1;
+        while (i < scan.threads && !steal_half(scan.shares[(index + i) % scan.threads], own))
+            i++;
+        if (i == scan.threads)
+            return;
+    }
+}
+
+static void *
+chunk_worker_main(void *arg)
+{
+    ChunkWorker *w = (ChunkWorker *) arg;
+    run_chunks(*w->scan, w->index);
+    return NULL;
+}
+
+size_t
+scan_chunk_size(size_t length, int threads)
+{
+    size_t size = length / (size_t(threads) * 16);
+    return size < 4096 ? 4096 : size;
+}
+
+size_t
+parallel_for_chunks(size_t length, size_t chunk_size, int threads, ChunkBody &body)
+{
+    if (chunk_size == 0 || threads < 1)
+        abort();
+    uint64_t chunks = length / chunk_size + (length % chunk_size != 0);
+    if (chunks > 0xffffffff)
+        abort();
+
+    ChunkShare *shares = new ChunkShare[threads];
+    for (int i = 0; i < threads; i++)
+        shares[i].range = pack_share(chunks * i / threads, chunks * (i + 1) / threads);
+    ChunkScan scan = { &body, shares, threads, length, chunk_size };
+
+    // The calling thread is worker 0.
+    ChunkWorker *workers = new ChunkWorker[threads];
+    for (int i = 1; i < threads; i++) {
+        workers[i].scan = &scan;
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread, NULL, chunk_worker_main, &workers[i]) != 0)
+            abort();
+    }
+    run_chunks(scan, 0);
+    for (int i = 1; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    delete[] workers;
+    delete[] shares;
+    return size_t(chunks);
+}
+
+#undef ATOMIC_LOAD
+#undef ATOMIC_STORE
+#undef ATOMIC_CAS
+
+#endif  // HAVE_PTHREADS
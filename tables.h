@@ -3,9 +3,27 @@
 
 #include <stdint.h>
 #include <cstdlib>
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TABLES_HAVE_SSE2
+#endif
 #ifdef HAVE_SPARSEHASH
 #include <sparsehash/dense_hash_map>
 #endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#ifdef HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#include <time.h>
+#endif
+#if defined(HAVE_PHASE_TIMING) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 // === Keys and values (common definitions used by both hash table implementations)
 
@@ -17,7 +35,14 @@ typedef uint64_t Key;
 typedef Key KeyArg;
 typedef uint64_t Value;
 typedef Value ValueArg;
+
+// Hash codes are as wide as a table index can be, so that a table with more
+// than 2^32 buckets can still reach all of them.
+#if SIZE_MAX > 0xffffffffu
+typedef uint64_t hashcode_t;
+#else
 typedef uint32_t hashcode_t;
+#endif
 
 inline hashcode_t hash(KeyArg k) { return k; }
 
@@ -35,22 +60,723 @@ inline bool isLive(KeyArg k) { return ((k + 1) & ~1) != 0; }
 
 enum ByteSizeOption { BytesAllocated, BytesWritten };
 
+// A key and its value. Every table has methods keys(), values() and
+// entries() that copy all its keys, values or KeyValues into an array, in
+// iteration order, and return how many they copied. That is always size(),
+// so the caller can size the array before the call.
+struct KeyValue {
+    Key key;
+    Value value;
+};
 
-#ifdef HAVE_SPARSEHASH
-// === DenseTable
-// The dense_hash_map type from Google sparsehash, included to give a baseline.
+// Return a 4-bit mask whose bit i is set if the ith key is live.
+inline unsigned live_mask4(KeyArg k0, KeyArg k1, KeyArg k2, KeyArg k3)
+{
+#ifdef TABLES_HAVE_SSE2
+    // isLive on two keys per instruction. (k + 1) & ~1 is zero for exactly
+    // the empty and tombstone keys. SSE2 can only compare 32 bits at a time,
+    // so a 64-bit lane is zero if both its halves are.
+    const __m128i one = _mm_set1_epi64x(1);
+    const __m128i not_one = _mm_set1_epi64x(~1LL);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_and_si128(_mm_add_epi64(_mm_set_epi64x((long long) k1, (long long) k0), one), not_one);
+    __m128i b = _mm_and_si128(_mm_add_epi64(_mm_set_epi64x((long long) k3, (long long) k2), one), not_one);
+    a = _mm_cmpeq_epi32(a, zero);
+    b = _mm_cmpeq_epi32(b, zero);
+    a = _mm_and_si128(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)));
+    b = _mm_and_si128(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 3, 0, 1)));
+    unsigned holes = unsigned(_mm_movemask_pd(_mm_castsi128_pd(a)))
+                   | unsigned(_mm_movemask_pd(_mm_castsi128_pd(b))) << 2;
+    return ~holes & 0xf;
+#else
+    return unsigned(isLive(k0)) | unsigned(isLive(k1)) << 1
+         | unsigned(isLive(k2)) << 2 | unsigned(isLive(k3)) << 3;
+#endif
+}
+
+// A key together with its hash code. A table's hashed() method makes one,
+// and has/get/set/remove/prefetch all accept one in place of a key, so a
+// caller doing several operations on the same key (has, then set) only pays
+// for hashing it once. A HashedKey holds the whole hash code, not a bucket
+// index, so it stays good when the table is resized. It is only good for
+// tables that use the same hash function as the one that made it.
+struct HashedKey {
+    Key key;
+    hashcode_t hash;
+};
+
+// A handle to a CloseTable entry, from find() or insert(). get_by_handle()
+// and set_by_handle() go straight to the entry, with no hashing and no chain
+// walk. A handle goes stale when its entry is removed or when the table
+// rehashes, which moves every entry; then those methods return false. A
+// handle is only good for the table that made it.
+//
+// The generation that detects rehashes is 32 bits and wraps around. A handle
+// kept across a multiple of 2^32 rehashes (counting compact() and shrinking)
+// looks current again, and may name whatever entry now has its index. Don't
+// keep handles that long.
+struct EntryHandle {
+    uint32_t index;         // the entry's index in the table's data vector
+    uint32_t generation;    // the table's generation when the handle was made
+};
+
+// Card marking, for tables whose values point into a generational GC's heap.
+// After enable_cards(), OpenTable and CloseTable divide their slots into
+// cards of CardSlots consecutive slots, and every write of a value marks its
+// slot's card dirty, as a GC write barrier would. A minor GC then calls
+// scan_dirty_cards(f), which calls f(key, value) for the live entries on
+// dirty cards only, passing value by reference so that f can update a
+// pointer to a moved object, and cleans the cards. Rehashing moves entries;
+// it carries the marks along with them.
+//
+// The cards are bytes rather than bits, so marking one is a single store. A
+// table without cards pays one test of a null pointer per write.
+static const size_t CardShift = 5;
+static const size_t CardSlots = size_t(1) << CardShift;
+
+// The cards for a table of the given number of slots are kept in 64-bit
+// words, so that scanning can skip 8 clean cards at a time.
+inline size_t card_words(size_t slots)
+{
+    size_t cards = (slots + CardSlots - 1) >> CardShift;
+    return (cards + 7) / 8;
+}
+
+inline void mark_card(uint64_t *cards, size_t slot)
+{
+    if (cards)
+        ((unsigned char *) cards)[slot >> CardShift] = 1;
+}
+
+inline bool card_is_dirty(const uint64_t *cards, size_t slot)
+{
+    return ((const unsigned char *) cards)[slot >> CardShift] != 0;
+}
+
+// The body of both tables' scan_dirty_cards: visit the live entries among
+// the first length of entries whose cards are dirty, clean every card, and
+// return how many cards were dirty.
+template <class Entry, class F>
+size_t scan_dirty_card_entries(uint64_t *cards, Entry *entries, size_t length, F &f)
+{
+    size_t dirty = 0;
+    for (size_t w = 0, words = card_words(length); w < words; w++) {
+        if (cards[w] == 0)
+            continue;
+        const unsigned char *c = (const unsigned char *) &cards[w];
+        for (size_t b = 0; b < 8; b++) {
+            if (!c[b])
+                continue;
+            dirty++;
+            size_t begin = (w * 8 + b) << CardShift;
+            size_t end = begin + CardSlots < length ? begin + CardSlots : length;
+            for (Entry *e = entries + begin, *stop = entries + end; e < stop; e++) {
+                if (isLive(e->key))
+                    f(e->key, e->value);
+            }
+        }
+        cards[w] = 0;
+    }
+    return dirty;
+}
+
+// The wire format of CloseTable::serialize and deserialize, for sending a
+// table to another process. It is a sequence of varints (7 bits per byte,
+// low bits first, the high bit set on every byte but the last), so it
+// doesn't depend on byte order or word size:
+//     the number of entries
+//     for each entry, in insertion order:
+//         the key minus the previous key (or minus 0), zigzag-encoded
+//         the value
+// Zigzag encoding maps signed deltas 0, -1, 1, -2... to 0, 1, 2, 3..., so
+// keys near their predecessors, ascending or descending, take one or two
+// bytes. A random 64-bit key still takes up to 10.
+static const size_t MaxVarintBytes = 10;
+
+inline unsigned char *write_varint(unsigned char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+// Read a varint from [p, end) into *v and return a pointer just past it, or
+// NULL if it runs past end or past 64 bits.
+inline const unsigned char *read_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+    uint64_t result = 0;
+    for (unsigned shift = 0; p != end; shift += 7) {
+        uint64_t byte = *p++;
+        if (shift == 63 && byte > 1)
+            return NULL;
+        result |= (byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+inline uint64_t zigzag(uint64_t delta) { return (delta << 1) ^ (0 - (delta >> 63)); }
+inline uint64_t unzigzag(uint64_t z) { return (z >> 1) ^ (0 - (z & 1)); }
+
+// Every table has a method prefetch(key), for callers that know a key some
+// time before they look it up (an interpreter can see a Map access coming a
+// few bytecodes ahead). It starts loading the memory a lookup of that key
+// will touch first, and returns without waiting for it.
+inline void prefetch_address(const void *p)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#elif defined(_MSC_VER)
+    _mm_prefetch((const char *) p, _MM_HINT_T0);
+#else
+    (void) p;
+#endif
+}
+
+// Static tracing. Built with -DHAVE_SDT, the tables contain USDT probes
+// (provider "tables") that bpftrace, perf or SystemTap can attach to at run
+// time:
+//     open_rehash, open_shrink     (old slots, new slots, live entries, ns)
+//     close_rehash, close_shrink   (old buckets, new buckets, live entries, ns)
+//     close_compact                (buckets, entries before, live entries, ns)
+//     open_long_probe              (slots probed, table slots)
+//     close_long_chain             (chain length, buckets)
+// The long_* probes fire on lookups that touch more than long_probe_length
+// slots or chain entries. A probe is a nop until a tracer attaches. Each
+// also has a semaphore, which the tracer sets, so that the tables can skip
+// work nobody will see; for instance, a rehash is only timed while someone is
+// watching. Without HAVE_SDT there is no code at all. hashbench -u checks
+// that the probes cost no more than noise when nobody is watching.
+static const size_t long_probe_length = 8;
+
+#ifdef HAVE_SDT
+#define TABLES_SEMAPHORE(name) tables_##name##_semaphore
+#define TABLES_DECLARE_PROBE(name) \
+    extern volatile unsigned short TABLES_SEMAPHORE(name) __attribute__((section(".probes")))
+TABLES_DECLARE_PROBE(open_rehash);
+TABLES_DECLARE_PROBE(open_shrink);
+TABLES_DECLARE_PROBE(close_rehash);
+TABLES_DECLARE_PROBE(close_shrink);
+TABLES_DECLARE_PROBE(close_compact);
+TABLES_DECLARE_PROBE(open_long_probe);
+TABLES_DECLARE_PROBE(close_long_chain);
+
+#define TABLES_PROBE_ENABLED(name) __builtin_expect(TABLES_SEMAPHORE(name) != 0, 0)
+#define TABLES_PROBE2(name, a, b) STAP_PROBE2(tables, name, a, b)
+#define TABLES_PROBE4(name, a, b, c, d) STAP_PROBE4(tables, name, a, b, c, d)
+
+inline uint64_t trace_clock_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+#else
+// The probes' arguments have no side effects. Casting them to void counts
+// as using them, so that variables computed only for a probe don't draw
+// unused-variable warnings, and the compiler still drops them.
+#define TABLES_PROBE_ENABLED(name) false
+#define TABLES_PROBE2(name, a, b) ((void) (a), (void) (b))
+#define TABLES_PROBE4(name, a, b, c, d) ((void) (a), (void) (b), (void) (c), (void) (d))
+
+inline uint64_t trace_clock_ns() { return 0; }
+#endif
+
+// Cycle attribution. Built with -DHAVE_PHASE_TIMING (x86 only), the core
+// tables read the time stamp counter between the phases of each operation
+// and add up the cycles spent in each one:
+//     PhaseHash       computing the hash code, in hashed()
+//     PhaseProbe      reaching the next candidate: loading an OpenTable
+//                     slot, or a CloseTable bucket or chain pointer
+//     PhaseCompare    testing candidates' keys; for CloseTable this includes
+//                     loading the entry, usually the lookup's second miss
+//     PhaseValue      reading or writing the value, storing a new entry, or
+//                     marking a removed one
+//     PhaseRehash     rehash(), including everything it calls
+// Each reading waits (lfence) for the loads before it, so the build runs much
+// slower than a normal one and the phases' shares, not their sum, are what
+// to look at. hashbench -k subtracts the cost of the readings and prints
+// cycles per operation. The counters are plain globals: time one thread at a
+// time. Without HAVE_PHASE_TIMING there is no code at all.
+#ifdef HAVE_PHASE_TIMING
+enum Phase { PhaseHash, PhaseProbe, PhaseCompare, PhaseValue, PhaseRehash, PhaseCount };
+
+struct PhaseCounters {
+    uint64_t cycles[PhaseCount];
+    uint64_t laps[PhaseCount];  // readings taken during each phase
+    uint64_t starts;            // readings that start a phase, outside any
+    unsigned paused;            // nonzero while in rehash()
+};
+extern PhaseCounters phase_counters;
+
+inline uint64_t phase_clock()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    uint32_t lo, hi;
+    __asm__ __volatile__("lfence\n\trdtsc\n\tlfence" : "=a"(lo), "=d"(hi) : : "memory");
+    return uint64_t(hi) << 32 | lo;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+#error "HAVE_PHASE_TIMING needs the x86 time stamp counter"
+#endif
+}
+
+// Inside rehash(), every reading is just part of the rehash's time.
+inline uint64_t phase_begin()
+{
+    if (phase_counters.paused)
+        phase_counters.laps[PhaseRehash]++;
+    else
+        phase_counters.starts++;
+    return phase_clock();
+}
+
+// Charge the cycles since start to phase, and start the next phase now.
+inline void phase_lap(uint64_t &start, Phase phase)
+{
+    uint64_t now = phase_clock();
+    if (phase_counters.paused) {
+        phase_counters.laps[PhaseRehash]++;
+    } else {
+        phase_counters.cycles[phase] += now - start;
+        phase_counters.laps[phase]++;
+    }
+    start = now;
+}
+
+#define TABLES_PHASE_START(t) uint64_t t = phase_begin()
+#define TABLES_PHASE(t, phase) phase_lap(t, phase)
+#define TABLES_PHASE_PAUSE() (phase_counters.paused++)
+#define TABLES_PHASE_RESUME() (phase_counters.paused--)
+#else
+#define TABLES_PHASE_START(t) ((void) 0)
+#define TABLES_PHASE(t, phase) ((void) 0)
+#define TABLES_PHASE_PAUSE() ((void) 0)
+#define TABLES_PHASE_RESUME() ((void) 0)
+#endif
+
+#include "tables-core.h"
+
+
+// === ShapeTable
+// A table for the many small Maps a program builds with the same keys in the
+// same order, like records. Such tables share a Shape: an immutable list of
+// keys with a little hash index mapping each key to its position. Each table
+// stores only its shape pointer and an array of values in that order.
+//
+// Shapes form a tree, as hidden classes do in a JavaScript engine. Adding a
+// new key to a table follows (or creates) the transition from its shape to
+// the shape with that key on the end, so tables that add the same keys in the
+// same order end up sharing a shape. Setting an existing key only changes the
+// value.
+//
+// A table whose keys stop looking like a record falls back to a CloseTable,
+// for good. That happens on any remove(), when it would need more than
+// MaxKeys keys, or when the key it adds is out of order: its shape already
+// has MaxTransitions transitions to other keys, so the tables sharing it
+// don't agree on a layout and another branch isn't worth the memory.
+//
+// The tree is not thread-safe; all tables using a tree must stay on one
+// thread. Shapes are only freed with their tree.
+//
+class ShapeTable {
+public:
+    enum { MaxKeys = 64, MaxTransitions = 8 };
+
+    class Tree;
 
-class DenseTable {
 private:
-    struct Hasher {
-        size_t operator()(KeyArg key) const { return hash(key); }
+    struct Shape {
+        Tree *tree;
+        const Shape *parent;
+        Shape *children;        // shapes this one has transitions to
+        Shape *next_sibling;    // next of parent's children
+        size_t child_count;
+        size_t length;          // number of keys
+        Key *keys;              // the keys, in order
+        uint8_t *index;         // hash index: position + 1, or 0 if empty
+        size_t index_mask;      // size of index, minus one
+
+        static const size_t NotFound = size_t(-1);
+
+        size_t find(KeyArg key) const;
+    };
+
+    const Shape *shape;         // NULL once this has fallen back to dict
+    Value *values;              // shape->length values, in shape order
+    CloseTable *dict;           // the fallback table, or NULL
+
+    // The values array holds a power of two, enough for length values.
+    static size_t values_capacity(size_t length);
+
+    void fall_back();
+
+    ShapeTable(const ShapeTable &);     // not copyable
+    void operator=(const ShapeTable &);
+
+public:
+    // A tree of shapes, shared by the tables created with it.
+    class Tree {
+        friend class ShapeTable;
+
+        Shape root;
+
+        Shape * add(const Shape *s, KeyArg key);
+        static void destroy_children(Shape *s);
+        static size_t subtree_bytes(const Shape *s);
+
+        Tree(const Tree &);             // not copyable
+        void operator=(const Tree &);
+
+    public:
+        Tree();
+        ~Tree();
+
+        // The tree used by tables created with the default constructor.
+        static Tree & shared();
+
+        size_t byte_size() const;
+    };
+
+    ShapeTable();
+    explicit ShapeTable(Tree &tree);
+    ~ShapeTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+
+    // True if this table has fallen back to a CloseTable.
+    bool is_dictionary() const { return dict != NULL; }
+};
+
+
+// === FrozenTable
+// A read-only map from integer keys to values, for big static maps where
+// memory per entry is what matters. The keys are sorted and stored with
+// Elias-Fano encoding, a few bits per key. The values are in an array in the
+// same order, so a key's rank (its index among the sorted keys) is the index
+// of its value.
+//
+// Elias-Fano splits each key into its low_bits low bits, stored packed in
+// `lower`, and its high part h, stored in unary in the bit vector `upper`:
+// key i sets bit h + i. So the keys with high part h are the 1 bits between
+// the (h-1)th and the hth 0 bit, and their ranks follow from the position.
+// With low_bits = floor(log2(max_key / n)), that takes about low_bits + 2
+// bits per key. To find the hth 0 bit quickly, zero_samples records where
+// every ZeroSampleRate-th 0 bit is, and we count the rest with popcount.
+//
+class FrozenTable {
+    enum { ZeroSampleRate = 256 };
+
+    size_t length;              // number of entries
+    Key max_key;
+    unsigned low_bits;
+    uint64_t *lower;            // length * low_bits bits
+    uint64_t *upper;            // upper_bits bits
+    size_t upper_bits;
+    size_t *zero_samples;       // position of every ZeroSampleRate-th 0 in upper
+    Value *values;              // in key order
+
+    static const size_t NotFound = size_t(-1);
+
+    static unsigned low_bits_for(size_t n, Key max_key);
+    static size_t upper_bits_for(size_t n, Key max_key);
+    static size_t words_for(size_t bits) { return bits / 64 + (bits % 64 != 0); }
+
+    uint64_t lower_at(size_t i) const;
+    size_t select_zero(size_t j) const;
+    size_t rank_of(KeyArg key) const;
+
+    FrozenTable(const FrozenTable &);   // not copyable
+    void operator=(const FrozenTable &);
+
+public:
+    // Make a table of the n given entries. The keys must be live and in
+    // strictly increasing order.
+    FrozenTable(const Key *keys, const Value *values, size_t n);
+    ~FrozenTable();
+
+    // Return what byte_size() would be for a table of n entries whose
+    // largest key is max_key, without building it.
+    static size_t byte_size_for(size_t n, Key max_key);
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+};
+
+
+// === QuotientTable
+// An open-addressing table that stores less than a whole key per entry.
+// Keys first go through perm(), an invertible mixing function. In a table
+// of 2^shift slots, the low shift bits of perm(key) pick the key's home
+// slot, and the entry stores only the rest, the quotient perm(key) >> shift,
+// in as few whole bytes as hold it. A byte in front says how far the entry
+// is from its home slot, which gives back the low bits; inverting perm()
+// gives back the key. So in a table of 1M slots an entry takes 1 + 6 + 8 =
+// 15 bytes instead of OpenTable's 16, and from 16M slots, 14.
+//
+// Collisions are resolved by linear probing with Robin Hood insertion: an
+// entry being inserted takes the slot of any entry closer to its own home,
+// and that one moves on instead. That keeps distances short, lets a lookup
+// stop as soon as it meets an entry closer to home than the key would be,
+// and lets remove() shift the following entries back instead of leaving a
+// tombstone. So the table can run fuller than OpenTable: it grows when it
+// is 7/8 full, and shrinks when it is 1/8 full.
+//
+class QuotientTable {
+    // Distances are stored plus one, so that 0 can mean an empty slot.
+    enum { MaxDistance = 254 };
+
+    uint8_t *slots;             // capacity records of record_size bytes
+    size_t mask;                // capacity minus one
+    unsigned shift;             // log2(capacity)
+    unsigned quotient_bytes;    // bytes per quotient: (64 - shift) / 8, rounded up
+    size_t record_size;         // 1 + quotient_bytes + sizeof(Value)
+    size_t live_count;
+
+    static const size_t NotFound = size_t(-1);
+
+    static uint64_t perm(Key key);
+    static Key unperm(uint64_t p);
+    static size_t min_fill(size_t capacity) { return capacity / 8; }
+    static size_t max_fill(size_t capacity) { return capacity - capacity / 8; }
+
+    uint8_t * record(size_t i) const { return slots + i * record_size; }
+    static uint64_t load_quotient(const uint8_t *r, unsigned bytes);
+    uint64_t quotient_at(const uint8_t *r) const { return load_quotient(r, quotient_bytes); }
+    void set_quotient(uint8_t *r, uint64_t q) const;
+    uint64_t perm_at(size_t i) const;
+    Value value_at(size_t i) const;
+
+    size_t find(KeyArg key) const;
+    bool insert(uint64_t &p, Value &value);
+    bool try_rehash(size_t new_capacity);
+    void rehash(size_t new_capacity);
+
+    QuotientTable(const QuotientTable &);   // not copyable
+    void operator=(const QuotientTable &);
+
+public:
+    QuotientTable();
+    ~QuotientTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+    void prefetch(KeyArg key) const;
+
+    size_t keys(Key *out) const;
+    size_t values(Value *out) const;
+    size_t entries(KeyValue *out) const;
+};
+
+
+// === FreezableTable
+// Most long-lived Maps stop changing soon after they are built, but a
+// CloseTable keeps its growth slack and its removed entries forever. A
+// FreezableTable is a CloseTable that a FreezePolicy can freeze once it has
+// gone unwritten for a while. The frozen form is a single block: the live
+// entries, in order, with no slack and no holes, followed by an index of
+// 32-bit entry numbers, open-addressed and at most 3/4 full. Reads work on
+// either form. The first write thaws the table, rebuilding the CloseTable in
+// the same order, so iteration order never changes.
+//
+// Tables opt in by naming a policy when they are made. The embedder calls
+// the policy's sweep() when it likes, say after each garbage collection; a
+// sweep freezes every table not written since cold_after sweeps ago. None of
+// this is thread-safe.
+
+class FreezableTable;
+
+class FreezePolicy {
+    friend class FreezableTable;
+
+    FreezableTable *tables;     // every table using this policy
+    uint64_t sweeps;            // number of sweeps so far
+    unsigned cold_after;
+
+    FreezePolicy(const FreezePolicy &);     // not copyable
+    void operator=(const FreezePolicy &);
+
+public:
+    explicit FreezePolicy(unsigned cold_after = 2);
+    ~FreezePolicy();
+
+    // Freeze the cold tables. Return how many were frozen.
+    size_t sweep();
+};
+
+class FreezableTable {
+    friend class FreezePolicy;
+
+    CloseTable *table;          // the mutable form, or NULL if frozen
+    uint8_t *frozen;            // the frozen form, or NULL
+    size_t frozen_length;       // number of entries in the frozen form
+    unsigned index_bits;        // log2 of the number of index slots
+    FreezePolicy *policy;       // NULL if this table never freezes
+    uint64_t last_write;        // policy->sweeps as of the last write
+    FreezableTable *next;       // next table in policy->tables
+    FreezableTable **prevp;     // the pointer that points to this table
+
+    const KeyValue * frozen_entries() const { return (const KeyValue *) frozen; }
+    const uint32_t * frozen_index() const {
+        return (const uint32_t *) (frozen + frozen_length * sizeof(KeyValue));
+    }
+    static size_t index_slot(KeyArg key, unsigned bits);
+    const KeyValue * find_frozen(KeyArg key) const;
+    void freeze();
+    void thaw();
+    void will_write();
+
+    FreezableTable(const FreezableTable &);     // not copyable
+    void operator=(const FreezableTable &);
+
+public:
+    // If policy is NULL, the table never freezes. The policy must outlive
+    // the table.
+    explicit FreezableTable(FreezePolicy *policy = NULL);
+    ~FreezableTable();
+
+    bool is_frozen() const { return frozen != NULL; }
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+    void prefetch(KeyArg key) const;
+
+    size_t keys(Key *out) const;
+    size_t values(Value *out) const;
+    size_t entries(KeyValue *out) const;
+};
+
+
+// === DirectTable
+// Many Maps are keyed by small dense integers, such as ids handed out 1, 2,
+// 3... A DirectTable stores such a Map as an array of values indexed by key,
+// with a bitmap saying which keys are present. Absent keys' values are kept
+// zero, so get() is a bounds check and a load. Iteration is in insertion
+// order, as for CloseTable, and the array keeps that order only as long as
+// every new key is bigger than all the keys before it, which is how ids are
+// usually handed out. The table stays direct while that holds and at least a
+// quarter of the array is in use. The first key that breaks either rule
+// moves all the entries, in key order, into a CloseTable, and from then on
+// the DirectTable is just a CloseTable.
+
+class DirectTable {
+    enum { MinSlots = 64 };     // a multiple of 64, the bits in a bitmap word
+
+    Value *slot_values;         // [k] is key k's value, or 0; NULL if migrated
+    uint64_t *present;          // bit k is set if key k is in the table
+    size_t slots;               // keys 0 to slots - 1 fit; a power of two
+    size_t live_count;
+    Key high;                   // the biggest key added since the table was last empty
+    CloseTable *table;          // the CloseTable, once migrated; otherwise NULL
+
+    bool is_present(KeyArg key) const { return (present[key >> 6] >> (key & 63)) & 1; }
+    static bool dense_enough(size_t live, size_t slots) {
+        return slots <= MinSlots || live >= slots / 4;
+    }
+    void reset();
+    void grow(size_t new_slots);
+    void migrate();
+
+    DirectTable(const DirectTable &);   // not copyable
+    void operator=(const DirectTable &);
+
+public:
+    DirectTable();
+    ~DirectTable();
+
+    bool is_direct() const { return table == NULL; }
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+    void prefetch(KeyArg key) const;
+
+    size_t keys(Key *out) const;
+    size_t values(Value *out) const;
+    size_t entries(KeyValue *out) const;
+};
+
+
+// === PackedCloseTable
+// A CloseTable in one allocation. CloseTable allocates its bucket array and
+// its entries separately, in the constructor and again in every rehash, so
+// each costs two trips to malloc, and the two arrays can land anywhere. A
+// PackedCloseTable puts the buckets and then the entries in a single block,
+// sized together: a new table's whole block is 272 bytes, a few cache lines
+// in one page. Otherwise it is a CloseTable (same load factors, same
+// insertion order) without Ranges, handles or in-place shrinking.
+
+class PackedCloseTable {
+    struct Entry {
+        Key key;
+        Value value;
+        Entry *chain;
     };
 
-    typedef google::dense_hash_map<Key, Value, Hasher> Map;
-    Map map;
+    typedef Entry *EntryPtr;
+
+    // As for CloseTable.
+    static size_t initial_buckets() { return 4; }
+    static size_t capacity_for(size_t buckets) {
+        return buckets / 3 * 8 + buckets % 3 * 8 / 3;
+    }
+    static size_t min_vector_fill(size_t length) {
+        return length / 4 + (length % 4 != 0);
+    }
+
+    // The block's size in 64-bit words. A power-of-two number (at least 4)
+    // of bucket pointers fills whole words, so the entries are aligned.
+    static size_t block_words(size_t buckets) {
+        size_t bytes = buckets * sizeof(EntryPtr) + capacity_for(buckets) * sizeof(Entry);
+        return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    }
+
+    EntryPtr *table;            // the block: the buckets, then the entries
+    Entry *data;                // the entries, just past the buckets
+    size_t table_mask;          // number of buckets, minus one
+    size_t entries_capacity;    // capacity_for(table_mask + 1)
+    size_t entries_length;      // number of initialized entries
+    size_t live_count;          // entries_length less removed entries
+
+    static EntryPtr * new_block(size_t buckets);
+    static void delete_block(EntryPtr *block, size_t buckets);
+    Entry * lookup(KeyArg key, hashcode_t h) const;
+    void rehash(size_t new_table_mask);
+
+    PackedCloseTable(const PackedCloseTable &);     // not copyable
+    void operator=(const PackedCloseTable &);
 
 public:
-    DenseTable();
+    PackedCloseTable();
+    ~PackedCloseTable();
 
     size_t byte_size(ByteSizeOption option) const;
     size_t size() const;
@@ -58,38 +784,201 @@ public:
     Value get(KeyArg key) const;
     void set(KeyArg key, ValueArg value);
     bool remove(KeyArg key);
+    void prefetch(KeyArg key) const;
+
+    size_t keys(Key *out) const;
+    size_t values(Value *out) const;
+    size_t entries(KeyValue *out) const;
 };
-#endif  // HAVE_SPARSEHASH
 
 
-// === OpenTable
-// A simple hash table with open addressing.
-// See <https://en.wikipedia.org/wiki/Hash_table#Open_addressing>.
+// === MemoryBudget
+// A process-wide soft limit on the memory tables use. Tables opt in by being
+// made as Budgeted<OpenTable> or Budgeted<CloseTable>, naming a budget; the
+// budget keeps the sum of their byte_size()s. When a change takes the sum
+// over the limit, the budget asks the other tables to compact(), dropping
+// their slack (growth room past what their live entries need), the ones with
+// the most slack first, until the sum is back under. The table whose change
+// went over is left alone: it is growing and would only have to grow again.
+// Holes that removal leaves in a CloseTable aren't slack: squeezing them out
+// doesn't change the table's byte_size(), so the budget never compacts a
+// table for its holes alone.
 //
-class OpenTable {
+// The limit is soft: if the slack runs out the sum stays over, and the budget
+// doesn't try again until the sum has grown by another 1/16 of the limit, so
+// that a process over its budget doesn't compact on every insert. None of
+// this is thread-safe.
+
+class MemoryBudget;
+
+class BudgetedTableBase {
+    friend class MemoryBudget;
+
+    MemoryBudget *budget;
+    BudgetedTableBase *next;        // next table in budget->tables
+    BudgetedTableBase **prevp;      // the pointer that points to this table
+    size_t counted_bytes;           // this table's share of budget->total
+
+    BudgetedTableBase(const BudgetedTableBase &);   // not copyable
+    void operator=(const BudgetedTableBase &);
+
+    void size_changed(size_t bytes);
+
+protected:
+    explicit BudgetedTableBase(MemoryBudget *budget);
+
+    // Call after anything that may change the table's byte_size.
+    void note_size(size_t bytes) {
+        if (bytes != counted_bytes)
+            size_changed(bytes);
+    }
+
+    virtual size_t slack_bytes() const = 0;
+    virtual void compact() = 0;
+
+public:
+    virtual ~BudgetedTableBase();
+};
+
+class MemoryBudget {
+    friend class BudgetedTableBase;
+
+    BudgetedTableBase *tables;
+    size_t limit;
+    size_t total;               // sum of the tables' byte_size()s
+    size_t quiet_until;         // don't reclaim again until total passes this
+    bool reclaiming;
+    size_t passes;
+    size_t reclaimed;
+
+    MemoryBudget(const MemoryBudget &);     // not copyable
+    void operator=(const MemoryBudget &);
+
+    size_t reclaim(BudgetedTableBase *except);
+
+public:
+    explicit MemoryBudget(size_t limit_bytes);
+    ~MemoryBudget();
+
+    size_t limit_bytes() const { return limit; }
+    size_t total_bytes() const { return total; }
+    void set_limit_bytes(size_t limit_bytes);
+
+    // Compact tables now, most slack first, until the total is under the
+    // limit. Return the bytes given back.
+    size_t reclaim() { return reclaim(NULL); }
+
+    // How many times the budget has reclaimed, and how many bytes in all.
+    size_t reclaim_passes() const { return passes; }
+    size_t reclaimed_bytes() const { return reclaimed; }
+};
+
+template <class Table>
+class Budgeted : public BudgetedTableBase {
+    Table table;
+
+    size_t slack_bytes() const { return table.slack_bytes(); }
+    void compact() {
+        table.compact();
+        note_size(table.byte_size(BytesAllocated));
+    }
+
+public:
+    explicit Budgeted(MemoryBudget *budget) : BudgetedTableBase(budget) {
+        note_size(table.byte_size(BytesAllocated));
+    }
+    ~Budgeted() { note_size(0); }
+
+    size_t byte_size(ByteSizeOption option) const { return table.byte_size(option); }
+    size_t size() const { return table.size(); }
+    bool has(KeyArg key) const { return table.has(key); }
+    Value get(KeyArg key) const { return table.get(key); }
+    void prefetch(KeyArg key) const { table.prefetch(key); }
+
+    void set(KeyArg key, ValueArg value) {
+        table.set(key, value);
+        note_size(table.byte_size(BytesAllocated));
+    }
+
+    bool remove(KeyArg key) {
+        bool removed = table.remove(key);
+        note_size(table.byte_size(BytesAllocated));
+        return removed;
+    }
+
+    size_t keys(Key *out) const { return table.keys(out); }
+    size_t values(Value *out) const { return table.values(out); }
+    size_t entries(KeyValue *out) const { return table.entries(out); }
+};
+
+
+#ifdef HAVE_MMAP
+// === MmapTable
+// A hash table for maps bigger than physical memory. All of its data lives
+// in a file-backed shared mapping, and the page cache decides what stays
+// resident.
+//
+// The mapping is an array of pages. Each page is a tiny CloseTable: a few
+// buckets and an entries array, with chains that never leave the page. A key
+// is assigned a home page by the low bits of its hash and a bucket within
+// the page by the next bits. So a lookup touches one page, and costs at most
+// one page fault, unless the home page has overflowed into the next page.
+// A lookup that follows overflows never walks more than max_overflow pages
+// past the home page, so it ends even when every page has overflowed.
+//
+// Entries are kept in insertion order within a page, but not across pages.
+//
+class MmapTable {
+private:
+    enum {
+        PageSize = 4096,
+        BucketBits = 6,
+        BucketsPerPage = 1 << BucketBits,
+        EntriesPerPage = 236
+    };
+
     struct Entry {
         Key key;
         Value value;
+    };
 
-        Entry() { makeEmpty(key); }
+    // Chain and bucket links are entry indexes plus one; zero ends a chain.
+    struct Page {
+        uint8_t length;          // number of initialized entries
+        uint8_t live;            // length less empty (removed) entries
+        uint8_t overflowed;      // nonzero if an insert spilled past this page
+                                 // since the last rehash
+        uint8_t unused[5];
+        uint8_t buckets[BucketsPerPage];
+        uint8_t chain[EntriesPerPage];
+        Entry entries[EntriesPerPage];
     };
 
-    Entry *table;           // power-of-2-sized flat hash table
-    size_t live_count;      // number of live entries
-    size_t nonempty_count;  // number of live and tombstone entries
-    size_t mask;            // size of table, in elements, minus 1
+    const char *dir;            // where to create backing files
+    int fd;                     // backing file (already unlinked)
+    char *base;                 // the mapping, PageSize bytes per Page
+    size_t page_mask;           // number of pages, minus one
+    unsigned page_bits;         // log2 of the number of pages
+    size_t live_count;          // number of live entries
+    size_t max_overflow;        // farthest any entry lives past its home page
 
-    static double min_fill_ratio() { return 0.25; }
-    static double max_fill_ratio() { return 0.75; }
+    static size_t max_fill(size_t pages) { return pages * EntriesPerPage / 4 * 3; }
+    static size_t min_fill(size_t pages) { return pages * EntriesPerPage / 4; }
 
-    inline Entry * lookup(KeyArg key);
-    inline const Entry * lookup(KeyArg key) const;
+    Page * page(size_t i) const { return (Page *) (base + i * PageSize); }
 
-    void rehash(size_t new_capacity);
+    void map_pages(size_t count);
+    void unmap_pages();
+    static Entry * lookup_in_page(Page *page, KeyArg key, size_t bucket);
+    inline Entry * lookup(KeyArg key) const;
+    void compact_page(Page *p);
+    void insert(KeyArg key, ValueArg value);
+    void rehash(size_t new_page_count);
 
 public:
-    OpenTable();
-    ~OpenTable();
+    // Backing files are created in dir, or in $TMPDIR or /tmp if dir is NULL.
+    explicit MmapTable(const char *dir = NULL);
+    ~MmapTable();
 
     size_t byte_size(ByteSizeOption option) const;
     size_t size() const;
@@ -97,55 +986,97 @@ public:
     Value get(KeyArg key) const;
     void set(KeyArg key, ValueArg value);
     bool remove(KeyArg key);
+    void prefetch(KeyArg key) const;
+
+    // Drop the table's pages from memory: write them back to the file and
+    // evict them from this process's resident set and from the page cache.
+    // The data is not lost; the next access to a page reads it back in from
+    // the file. Where the kernel can't evict cached file pages (no
+    // posix_fadvise, or a file on tmpfs), the next access only faults the
+    // page back in from the page cache.
+    void release_resident();
 };
+#endif  // HAVE_MMAP
 
 
-// === CloseTable
-// A vector combined with a very simple hash table for fast lookup.
-// Tyler Close proposed this.
+#ifdef HAVE_PTHREADS
+// === VersionedCloseTable
+// A CloseTable that other threads can iterate over while the thread that
+// owns it keeps modifying it. Only the owner may call the methods of the
+// table itself; any thread may take a Snapshot.
+//
+// This uses multiversion concurrency control. The owner numbers its
+// modifications 1, 2, 3... (these are "epochs"). Each entry records the
+// epoch that added it and the one that removed it, and entries are never
+// changed otherwise: set() on an existing key removes the old entry and
+// appends a new one. A Snapshot reads the current epoch E when it is taken
+// and then sees exactly the entries that were live at E, even as the owner
+// keeps appending and removing. It needs no locks, only a few atomic loads
+// per entry.
+//
+// When the entries array is full, the owner copies the live entries to a
+// new array (the "store") and publishes it. Snapshots taken earlier keep
+// using the old store, so the owner then waits for all of them to finish
+// before freeing it. Snapshots should therefore be short-lived, and the
+// owner must not hold one while modifying the table.
 //
-class CloseTable {
+class VersionedCloseTable {
+public:
+    typedef uint64_t Epoch;
+    enum { MaxReaders = 64 };
+
 private:
-    // The number of buckets in the table initially.
-    // This must be a power of two.
     static size_t initial_buckets() { return 4; }
 
-    // The maximum load factor (mean number of entries per bucket).
-    // It is an invariant that
-    //     entries_capacity == floor((table_mask + 1) * fill_factor()).
-    //
-    // This fill factor was chosen to make the size of the entries
-    // array, in bytes, close to a power of two. (sizeof(Entry)
-    // is 24 on both 32-bit and 64-bit systems.)
-    //
-    static double fill_factor() { return 8.0 / 3.0; }
+    // Same load factor as CloseTable.
+    static size_t capacity_for(size_t buckets) {
+        return buckets / 3 * 8 + buckets % 3 * 8 / 3;
+    }
 
-    // The minimum permitted value of (live_count / entries_length).
-    // If that ratio drops below this value, we shrink the table.
-    static double min_vector_fill() { return 0.25; }
+    static Epoch forever() { return ~Epoch(0); }
 
     struct Entry {
         Key key;
         Value value;
         Entry *chain;
+        Epoch born;         // the epoch that added this entry
+        Epoch died;         // the epoch that removed it, or forever(); atomic
     };
 
     typedef Entry *EntryPtr;
 
-    EntryPtr *table;            // power-of-2-sized hash table
+    struct Store {
+        size_t capacity;    // size of entries, in elements
+        size_t length;      // number of initialized entries; atomic
+        Entry entries[1];
+    };
+
+    // Each Snapshot occupies one of these while it is alive, recording which
+    // Store it is reading. NULL means the slot is free. Each is on its own
+    // cache line so that readers don't slow each other down.
+    struct ReaderSlot {
+        Store *store;       // atomic
+        char padding[64 - sizeof(Store *)];
+    };
+
+    EntryPtr *table;            // power-of-2-sized hash table; owner only
     size_t table_mask;          // size of table, in elements, minus one
-    Entry *entries;             // data vector, an array of Entry objects
-    size_t entries_capacity;    // size of entries, in elements
-    size_t entries_length;      // number of initialized entries
-    size_t live_count;          // entries_length less empty (removed) entries
+    Store *store;               // current store; atomic
+    size_t live_count;          // number of live entries
+    Epoch epoch;                // the latest modification; atomic
+    ReaderSlot readers[MaxReaders];
 
-    inline Entry * lookup(KeyArg key, hashcode_t h);
-    inline const Entry * lookup(KeyArg key) const;
+    static Store * new_store(size_t capacity);
+    inline Entry * lookup(KeyArg key) const;
+    void append(KeyArg key, ValueArg value, Epoch born);
     void rehash(size_t new_table_mask);
 
+    VersionedCloseTable(const VersionedCloseTable &);   // not copyable
+    void operator=(const VersionedCloseTable &);
+
 public:
-    CloseTable();
-    ~CloseTable();
+    VersionedCloseTable();
+    ~VersionedCloseTable();
 
     size_t byte_size(ByteSizeOption option) const;
     size_t size() const;
@@ -153,7 +1084,255 @@ public:
     Value get(KeyArg key) const;
     void set(KeyArg key, ValueArg value);
     bool remove(KeyArg key);
+    void prefetch(KeyArg key) const;
+
+    // A consistent view of the table's live entries as of the moment it was
+    // taken, in insertion order. At most MaxReaders Snapshots of one table
+    // may exist at a time; more will wait for one to be destroyed.
+    class Snapshot {
+        ReaderSlot *slot;
+        Epoch epoch;
+        const Entry *entries;
+        size_t length;
+        size_t i;
+
+        void seek();
+
+        Snapshot(const Snapshot &);     // not copyable
+        void operator=(const Snapshot &);
+
+    public:
+        explicit Snapshot(VersionedCloseTable &table);
+        ~Snapshot();
+
+        bool empty() const { return i >= length; }
+        Key front_key() const { return entries[i].key; }
+        Value front_value() const { return entries[i].value; }
+        void popFront() { i++; seek(); }
+    };
 };
+#endif  // HAVE_PTHREADS
+
+#ifdef HAVE_PTHREADS
+// === AtomTable
+// An intern table for strings. atomize() maps a string's contents to a
+// canonical Atom, so that equal strings get the same Atom pointer. Any number
+// of threads may call lookup() and atomize() at the same time.
+//
+// The layout is OpenTable's: a flat, power-of-2-sized array probed with
+// double hashing. Each slot caches its atom's hash code beside the atom
+// pointer, so a probe almost never looks at the characters of the wrong atom.
+//
+// lookup() takes no locks. A slot is filled by a compare-and-swap of its atom
+// pointer, and atoms never change afterward, so a reader sees either an empty
+// slot or a complete atom. atomize() does a lookup() first; if the string is
+// absent, it takes one of LockCount locks, chosen by the hash code, looks
+// again, and inserts. Inserts of different strings usually take different
+// locks. Two such inserts can race for the same empty slot; the
+// compare-and-swap decides which one gets it, and the other probes on.
+//
+// Growing the slot array takes all the locks. Threads may still be probing
+// the old array, so it isn't freed until the next sweep(). A lookup() that
+// races with growth can miss an atom added meanwhile; atomize() then finds it
+// under the lock.
+//
+// Atoms are only freed by sweep(). Between sweeps the program calls mark() on
+// every atom it still uses, and sweep() frees the rest. Like a garbage
+// collector's sweep, sweep() must not run at the same time as anything else
+// on the table, and neither may mark(). An atom created after the marking is
+// unmarked, and the next sweep() frees it.
+//
+class AtomTable {
+public:
+    class Atom {
+        friend class AtomTable;
+
+        hashcode_t hash;
+        size_t length_;
+        bool marked;
+        char chars_[1];     // really length_ + 1 chars, with a trailing '\0'
+
+    public:
+        const char * chars() const { return chars_; }
+        size_t length() const { return length_; }
+    };
+
+    enum { LockCount = 64 };
+
+private:
+    struct Slot {
+        hashcode_t hash;    // atomic; written just after atom
+        Atom *atom;         // atomic; NULL if the slot is empty
+    };
+
+    struct SlotArray {
+        size_t mask;            // number of slots, minus one
+        SlotArray *retired;     // next retired array, awaiting sweep()
+        Slot slots[1];
+    };
+
+    // Each lock is on its own cache line so that threads taking different
+    // locks don't slow each other down.
+    struct Lock {
+        pthread_mutex_t mutex;
+        char padding[64 - sizeof(pthread_mutex_t) % 64];
+    };
+
+    static size_t max_fill(size_t capacity) { return capacity - capacity / 4; }
+    static hashcode_t hash_chars(const char *chars, size_t length);
+    static SlotArray * new_slot_array(size_t capacity);
+    static const Atom * find(const SlotArray *a, const char *chars, size_t length, hashcode_t h);
+    static bool insert(SlotArray *a, Atom *atom);
+
+    SlotArray *slots;           // atomic
+    SlotArray *retired;         // arrays replaced by grow(); under all locks
+    size_t count;               // number of atoms; atomic
+    Lock locks[LockCount];
+
+    void grow(SlotArray *full);
+
+    AtomTable(const AtomTable &);   // not copyable
+    void operator=(const AtomTable &);
+
+public:
+    AtomTable();
+    ~AtomTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+
+    // Return the atom for the given string, or NULL if there is none.
+    const Atom * lookup(const char *chars, size_t length) const;
+
+    // Return the atom for the given string, creating it if there is none.
+    const Atom * atomize(const char *chars, size_t length);
+
+    void mark(const Atom *atom);
+    void sweep();
+};
+#endif  // HAVE_PTHREADS
+
+
+#ifdef HAVE_PTHREADS
+// === Parallel scans
+// Scans and reductions over the entries of a big OpenTable or CloseTable,
+// split across threads. The table's slots are cut into chunks, and each
+// thread starts with an equal, contiguous share of the chunks. A thread
+// takes chunks from the front of its own share. When its share runs out, it
+// steals the back half of another thread's share, so threads that finish
+// early help the slow ones instead of going idle. The table must not change
+// during the scan.
+
+// Work to be done on chunks of a range. run() is called once for each chunk,
+// possibly from several threads at once. thread is the index of the calling
+// thread, from 0 to the thread count minus one; chunk is the index of the
+// chunk, which covers [begin, end).
+class ChunkBody {
+public:
+    virtual void run(int thread, size_t chunk, size_t begin, size_t end) = 0;
+
+protected:
+    ~ChunkBody() {}
+};
+
+// Return the chunk size parallel_for_each and parallel_reduce use: big
+// enough that taking a chunk costs little next to scanning it, small enough
+// to give each thread about 16 chunks to share out.
+size_t scan_chunk_size(size_t length, int threads);
+
+// Run body on every chunk of [0, length), with the given number of threads,
+// counting the calling thread. Return the number of chunks.
+size_t parallel_for_chunks(size_t length, size_t chunk_size, int threads, ChunkBody &body);
+
+template <class Table, class F>
+class ForEachBody : public ChunkBody {
+    const Table &table;
+    F &f;
+
+public:
+    ForEachBody(const Table &table, F &f) : table(table), f(f) {}
+    void run(int, size_t, size_t begin, size_t end) { table.scan_slots(begin, end, f); }
+};
+
+// Call f(key, value) for every live entry of the table, from several threads
+// at once, in no particular order.
+template <class Table, class F>
+void parallel_for_each(const Table &table, F &f, int threads)
+{
+    ForEachBody<Table, F> body(table, f);
+    size_t length = table.slot_count();
+    parallel_for_chunks(length, scan_chunk_size(length, threads), threads, body);
+}
+
+// A Reducer for parallel_reduce has:
+//     typedef ... Result;
+//     Result identity() const;
+//     void add(Result &acc, KeyArg key, ValueArg value) const;
+//     void merge(Result &acc, const Result &later) const;
+// merge(acc, later) must leave acc as if the entries added to later had been
+// added to acc after its own. add and merge are called from several threads
+// at once, on different Results.
+template <class Table, class Reducer>
+class ReduceBody : public ChunkBody {
+    typedef typename Reducer::Result Result;
+
+    struct Adder {
+        const Reducer &reducer;
+        Result acc;
+
+        explicit Adder(const Reducer &reducer) : reducer(reducer), acc(reducer.identity()) {}
+        void operator()(KeyArg key, ValueArg value) { reducer.add(acc, key, value); }
+    };
+
+    const Table &table;
+    const Reducer &reducer;
+    bool ordered;
+    Result *partials;   // one per chunk if ordered, else one per thread
+
+public:
+    ReduceBody(const Table &table, const Reducer &reducer, bool ordered, Result *partials)
+      : table(table), reducer(reducer), ordered(ordered), partials(partials) {}
+
+    // Each chunk is reduced into a local Result first, so that threads write
+    // to the shared partials only once per chunk.
+    void run(int thread, size_t chunk, size_t begin, size_t end) {
+        Adder adder(reducer);
+        table.scan_slots(begin, end, adder);
+        if (ordered)
+            partials[chunk] = adder.acc;
+        else
+            reducer.merge(partials[thread], adder.acc);
+    }
+};
+
+// Reduce the live entries of the table with several threads. If ordered is
+// true, the chunks' results are merged in slot order, so the result is the
+// same as a one-thread scan's even if merge isn't commutative; for a
+// CloseTable that is insertion order. Otherwise each thread's chunks are
+// merged into that thread's result in whatever order it ran them, which
+// saves a Result per chunk but is only right if merge is commutative.
+template <class Table, class Reducer>
+typename Reducer::Result
+parallel_reduce(const Table &table, const Reducer &reducer, int threads, bool ordered)
+{
+    typedef typename Reducer::Result Result;
+    size_t length = table.slot_count();
+    size_t chunk_size = scan_chunk_size(length, threads);
+    size_t n = ordered ? (length + chunk_size - 1) / chunk_size : size_t(threads);
+    Result *partials = new Result[n ? n : 1];
+    for (size_t i = 0; i < n; i++)
+        partials[i] = reducer.identity();
+
+    ReduceBody<Table, Reducer> body(table, reducer, ordered, partials);
+    parallel_for_chunks(length, chunk_size, threads, body);
+
+    Result result = reducer.identity();
+    for (size_t i = 0; i < n; i++)
+        reducer.merge(result, partials[i]);
+    delete[] partials;
+    return result;
+}
+#endif  // HAVE_PTHREADS
 
 
 #endif  // tables_h_